@@ -0,0 +1,56 @@
+#!/bin/sh
+# Compares the throughput, latency and host CPU of traffic between two
+# containers, with and without --fast-path. ROOTFS must have iperf3 and ping.
+#
+# Every run takes new addresses, since the network namespace of a container
+# may outlive it for a while with its address.
+#
+# Usage: bench/east_west.sh MINI_CONTAINER ROOTFS [SECONDS] [MODES]
+# e.g.:  bench/east_west.sh build/mini_container /tmp/rootfs 10 "bridge routed"
+set -e
+
+if [ $# -lt 2 ]; then
+  sed -n '2,9s/^# \?//p' "$0"
+  exit 1
+fi
+
+MINI_CONTAINER="$(realpath "$1")"
+ROOTFS="$2"
+DURATION="${3:-10}"
+MODES="${4:-bridge routed}"
+
+# Prints the busy and total jiffies of all CPUs.
+cpu_times() {
+  awk '/^cpu / {
+    busy = $2 + $3 + $4 + $7 + $8
+    print busy, busy + $5 + $6
+  }' /proc/stat
+}
+
+printf "%8s %10s %16s %10s %8s\n" mode fast-path "iperf3 (Mbit/s)" \
+  "ping (ms)" "CPU (%)"
+n=100
+for mode in $MODES; do
+  for fast_path in "" --fast-path; do
+    n=$((n + 1))
+    server=10.0.1.$n
+    run="$MINI_CONTAINER -r $ROOTFS --net-mode $mode $fast_path"
+
+    $run --ip "$server" iperf3 -s -1 > /dev/null &
+    container=$!
+    sleep 1
+    latency=$($run --ip 10.0.2.$n ping -c 100 -i 0.01 -q "$server" |
+      sed -n 's|^rtt [^=]*= [^/]*/\([^/]*\)/.*|\1|p')
+    before=$(cpu_times)
+    throughput=$($run --ip 10.0.2.$n iperf3 -c "$server" -t "$DURATION" -f m |
+      awk '/receiver/ { print $7 }')
+    after=$(cpu_times)
+    wait $container
+    cpu=$(echo "$before $after" |
+      awk '{ printf "%.1f", 100 * ($3 - $1) / ($4 - $2) }')
+    label=no
+    [ -n "$fast_path" ] && label=yes
+    printf "%8s %10s %16s %10s %8s\n" "$mode" "$label" \
+      "$throughput" "$latency" "$cpu"
+  done
+done
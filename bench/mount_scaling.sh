@@ -0,0 +1,50 @@
+#!/bin/sh
+# Measures how the start time of a container grows with the number of mounts
+# on the host, with and without --minimal-mountns.
+#
+# The extra mounts are created in a private mount namespace, so the host is
+# left untouched.
+#
+# Usage: bench/mount_scaling.sh MINI_CONTAINER ROOTFS [RUNS] [MOUNT_COUNTS]
+# e.g.:  bench/mount_scaling.sh build/mini_container /tmp/rootfs 20 "0 1000 5000"
+set -e
+
+if [ $# -lt 2 ]; then
+  sed -n '2,9s/^# \?//p' "$0"
+  exit 1
+fi
+
+export MINI_CONTAINER="$(realpath "$1")"
+export ROOTFS="$2"
+export RUNS="${3:-20}"
+export COUNTS="${4:-0 1000 2000 5000}"
+
+unshare --mount --propagation private sh -e -c '
+  mkdir -p /tmp/mount_scaling
+  mount -t tmpfs tmpfs /tmp/mount_scaling
+  mounted=0
+  printf "%8s %14s %14s\n" mounts "copy (ms)" "minimal (ms)"
+  for count in $COUNTS; do
+    while [ "$mounted" -lt "$count" ]; do
+      mkdir /tmp/mount_scaling/$mounted
+      mount -t tmpfs tmpfs /tmp/mount_scaling/$mounted
+      mounted=$((mounted + 1))
+    done
+    for mode in "" --minimal-mountns; do
+      # Warm up, which also creates the template mount namespace.
+      "$MINI_CONTAINER" -v $mode -r "$ROOTFS" /bin/true > /dev/null
+      start=$(date +%s%N)
+      i=0
+      while [ $i -lt "$RUNS" ]; do
+        "$MINI_CONTAINER" -v $mode -r "$ROOTFS" /bin/true > /dev/null
+        i=$((i + 1))
+      done
+      end=$(date +%s%N)
+      [ -n "$mode" ] && minimal=$(((end - start) / RUNS / 1000))
+      [ -z "$mode" ] && copy=$(((end - start) / RUNS / 1000))
+    done
+    printf "%8d %14s %14s\n" "$(wc -l < /proc/self/mountinfo)" \
+      "$((copy / 1000)).$((copy % 1000 / 100))" \
+      "$((minimal / 1000)).$((minimal % 1000 / 100))"
+  done
+'
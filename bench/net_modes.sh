@@ -0,0 +1,69 @@
+#!/bin/sh
+# Compares the host-to-container throughput and latency of the --net-mode
+# modes. ROOTFS must have iperf3, and the host iperf3 and ping.
+#
+# The host reaches a macvlan or ipvlan container through a sibling interface
+# of the same type on PARENT, on the scratch network 172.31.254.0/24.
+#
+# The ipvlan modes are untested: the kernel they were written against had no
+# ipvlan support.
+#
+# Usage: bench/net_modes.sh MINI_CONTAINER ROOTFS PARENT [SECONDS] [MODES]
+# e.g.:  bench/net_modes.sh build/mini_container /tmp/rootfs eth0 10 "bridge macvlan"
+set -e
+
+if [ $# -lt 3 ]; then
+  sed -n '2,12s/^# \?//p' "$0"
+  exit 1
+fi
+
+MINI_CONTAINER="$(realpath "$1")"
+ROOTFS="$2"
+PARENT="$3"
+DURATION="${4:-10}"
+MODES="${5:-bridge routed macvlan ipvlan-l2 ipvlan-l3}"
+HOST_LINK=mcbench0
+
+trap 'ip link del "$HOST_LINK" 2> /dev/null || true' EXIT
+
+printf "%10s %16s %14s\n" mode "iperf3 (Mbit/s)" "ping (ms)"
+for mode in $MODES; do
+  ip link del "$HOST_LINK" 2> /dev/null || true
+  ip=
+  case "$mode" in
+    bridge|routed)
+      ip=10.0.0.254
+      args="--ip $ip --net-mode $mode"
+      ;;
+    macvlan)
+      ip link add "$HOST_LINK" link "$PARENT" type macvlan mode bridge
+      ;;
+    ipvlan-l2)
+      ip link add "$HOST_LINK" link "$PARENT" type ipvlan mode l2
+      ;;
+    ipvlan-l3)
+      ip link add "$HOST_LINK" link "$PARENT" type ipvlan mode l3
+      ;;
+    *)
+      echo "Unknown mode $mode" >&2
+      exit 1
+      ;;
+  esac
+  if [ -z "$ip" ]; then
+    ip addr add 172.31.254.1/24 dev "$HOST_LINK"
+    ip link set "$HOST_LINK" up
+    ip=172.31.254.2
+    args="--ip $ip/24 --net-mode $mode --net-parent $PARENT"
+  fi
+
+  "$MINI_CONTAINER" -r "$ROOTFS" $args iperf3 -s -1 > /dev/null &
+  container=$!
+  sleep 1
+  # The average round trip, and what the container received.
+  latency=$(ping -c 100 -i 0.01 -q "$ip" |
+    sed -n 's|^rtt [^=]*= [^/]*/\([^/]*\)/.*|\1|p')
+  throughput=$(iperf3 -c "$ip" -t "$DURATION" -f m |
+    awk '/receiver/ { print $7 }')
+  wait $container
+  printf "%10s %16s %14s\n" "$mode" "$throughput" "$latency"
+done
@@ -1,16 +1,72 @@
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <glob.h>
+#include <grp.h>
+#include <ifaddrs.h>
 #include <limits.h>
+#include <linux/loop.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/audit.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/gen_stats.h>
+#include <linux/if_ether.h>
+#include <linux/io_uring.h>
+#include <linux/ip.h>
+#include <linux/magic.h>
+#include <linux/openat2.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
+#include <linux/sched.h>
+#include <linux/seccomp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <sys/xattr.h>
+#include <termios.h>
+#include <wordexp.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <set>
 #include <sstream>
+#include <thread>
+#include <tuple>
 
 #define NIS_DOMAIN_NAME_MAX (64)
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 void errExit(const char* msg) {
   perror(msg);
   exit(EXIT_FAILURE);
@@ -21,16 +77,773 @@ namespace po = boost::program_options;
 const std::string kDefaultBridgeName = "br0";
 const std::string kDefaultBridgeIp = "10.0.0.1";
 const std::string kDefaultBridgePrefixLen = "16";
+// How a container with --ip is connected to the host, see NetworkOptions.
+const std::vector<std::string> kNetModes = {
+    "bridge", "routed", "macvlan", "ipvlan-l2", "ipvlan-l3",
+    "none", "loopback", "host"};
+// The gateway of a routed container, answered by proxy ARP on its veth.
+const std::string kRoutedGatewayIp = "169.254.1.1";
 
 // The code assumes this cgroup already exists and all controllers are enabled.
 const std::string kCgroupRoot = "/sys/fs/cgroup/mini_container/";
+const std::string kDefaultPath =
+    "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin";
+
+// The most the agent moves from a log pipe at once, which is also the size of
+// the pipes, and how much of the tail is dropped at once when it is full.
+const size_t kLogChunkSize = 1024 * 1024;
+const size_t kLogTailDropSize = 16 * 1024;
+// Layout of the log ring of a container, see LogRingHeader.
+const uint64_t kLogRingMagic = 0x676e69725f676f6c;  // "log_ring"
+const off_t kLogRingDataOffset = 4096;
+const size_t kLogRecordMaxLength = 64 * 1024;
+const uint32_t kLogRecordPadding = 0;
+// Size of the io_uring of the log relay, which has a poll and a splice in
+// flight per stream.
+const unsigned kLogUringEntries = 16;
+// How often "logs -f" checks for new output.
+const useconds_t kLogFollowIntervalUs = 50 * 1000;
+
+// The most the tty relay moves at once, and the keys that detach a terminal
+// from the tty of a container, Ctrl-P Ctrl-Q.
+const size_t kTtyChunkSize = 64 * 1024;
+const char kDetachKeys[2] = {0x10, 0x11};
+
+// The most fds passed in one message over a unix socket.
+const int kMaxPassedFds = 4;
+
+// State shared by all mini_container agents on the host.
+const std::string kStateRoot = "/run/mini_container/";
+// Pinned mount namespace that only contains an empty tmpfs.
+const std::string kMountNsTemplate = kStateRoot + "mntns";
+// State of the running containers, in a directory per container named by its
+// name or pid.
+const std::string kContainerStateRoot = kStateRoot + "containers/";
+// The address allocator of the default bridge network, see IpamHeader.
+const std::string kIpamPath = kStateRoot + "ipam";
+const uint64_t kIpamMagic = 0x32765f6d6170695f;  // "_ipam_v2"
+const size_t kIpamBitmapOffset = 64;
+// The nftables table of published ports, and its map from host port to
+// container address and port.
+const std::string kNftTable = "mini_container";
+const std::string kNftPortMap = "ports";
+// The bpf filesystem of the agents, and the map of the fast path in it from
+// the address of a container to the ifindex of its veth.
+const std::string kBpfRoot = kStateRoot + "bpf";
+const std::string kFastPathMapPath = kBpfRoot + "/fast_path";
+// The default burst of --net-rate, and how long packets may wait for the
+// rate before they are dropped.
+const uint32_t kDefaultNetBurst = 64 * 1024;
+const uint64_t kNetQueueLatencyUs = 50 * 1000;
+// Namespaces of a running container that a new container can join, and their
+// clone flags.
+const std::vector<std::pair<std::string, int>> kJoinableNamespaces = {
+    {"net", CLONE_NEWNET},
+    {"ipc", CLONE_NEWIPC},
+    {"uts", CLONE_NEWUTS},
+    {"pid", CLONE_NEWPID},
+    {"mnt", CLONE_NEWNS}};
 bool verbose = false;
 
+// Filesystem types supported for rootfs image files, and the magic numbers
+// found in their superblocks.
+const std::string kErofsType = "erofs";
+const std::string kSquashfsType = "squashfs";
+const uint32_t kErofsMagic = 0xE0F5E1E2;
+const off_t kErofsMagicOffset = 1024;
+const uint32_t kSquashfsMagic = 0x73717368;
+const off_t kSquashfsMagicOffset = 0;
+
 struct ResourceLimit {
   long long maxRamBytes;
   ResourceLimit() : maxRamBytes(0) {}
 };
 
+// Host uids and gids that the container's uids and gids 0..count-1 are mapped
+// to in its user namespace. A count of 0 means no user namespace.
+struct IdMapping {
+  uid_t hostId;
+  uid_t count;
+  IdMapping() : hostId(0), count(0) {}
+};
+
+// Where and how the agent keeps the output of the container.
+struct LogOptions {
+  // Empty if the output isn't captured.
+  std::string dir;
+  // Size at which a log file is rotated, or 0 to never rotate.
+  long long maxSize;
+  // Number of rotated log files to keep.
+  int maxFiles;
+  // Size of the in-memory tail of the output, printed if the container fails.
+  int tailSize;
+  // Size of the log ring that readers like "logs -f" follow, or 0 for none.
+  size_t ringSize;
+  int devNullFd;
+  LogOptions()
+      : maxSize(0),
+        maxFiles(5),
+        tailSize(64 * 1024),
+        ringSize(1024 * 1024),
+        devNullFd(-1) {}
+};
+
+// A read-only rootfs image attached to a loop device by the agent.
+struct RootfsImage {
+  std::string device;
+  std::string fsType;
+  // Kept open by the agent until the container exits. The loop device is
+  // auto-cleared once this is closed and the image is no longer mounted.
+  int loopfd;
+  // Whether to put a writable tmpfs overlay on top of the image.
+  bool overlay;
+  RootfsImage() : loopfd(-1), overlay(false) {}
+};
+
+// A host path mounted into the container, given as
+// HOST_PATH:CONTAINER_PATH[:OPTIONS], or a tmpfs, given as
+// CONTAINER_PATH[:OPTIONS].
+struct Volume {
+  // Empty for a tmpfs.
+  std::string hostPath;
+  std::string containerPath;
+  // Parameters of a tmpfs, e.g. size and huge.
+  std::vector<std::pair<std::string, std::string>> tmpfsParams;
+  // MOUNT_ATTR_* flags to set and clear on the whole mount tree.
+  struct mount_attr attr;
+  // Detached mount tree prepared by the agent.
+  int treefd;
+  Volume() : attr(), treefd(-1) {}
+};
+
+// The command of the container. The agent prepares it completely, so that the
+// container only needs to exec it.
+struct Command {
+  std::vector<std::string> args;
+  // KEY=VALUE environment variables.
+  std::vector<std::string> env;
+  // Null terminated pointers into args and env for exec.
+  std::vector<char*> argv;
+  std::vector<char*> envp;
+  // The executable, opened in the container root by the agent, and its path
+  // in the container.
+  int fd;
+  std::string path;
+  // The seccomp filter installed right before exec, if any, and the socket to
+  // send its listener to the agent on, for --seccomp-record.
+  std::vector<struct sock_filter> seccompFilter;
+  int seccompSocket;
+  // Write ends of the pipes that stdout and stderr are redirected to, if the
+  // output is captured.
+  int stdoutFd;
+  int stderrFd;
+  // The pty slave that becomes the controlling terminal, with --tty.
+  int ttyFd;
+  Command()
+      : fd(-1), seccompSocket(-1), stdoutFd(-1), stderrFd(-1), ttyFd(-1) {}
+};
+
+// Returns the index of the first argument that isn't an option or an option
+// value, i.e. where the container command starts. Arguments after it belong
+// to the command, even if they look like options.
+int findCommandStart(
+    int argc,
+    char** argv,
+    const po::options_description& options) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--") {
+      return i + 1;
+    }
+    if (arg.size() < 2 || arg[0] != '-') {
+      return i;
+    }
+    // Values given as --name=VALUE or -nVALUE are part of the argument.
+    const bool isLong = arg[1] == '-';
+    if (isLong ? arg.find('=') != std::string::npos : arg.size() > 2) {
+      continue;
+    }
+    try {
+      const po::option_description* option =
+          options.find_nothrow(isLong ? arg.substr(2) : arg, false);
+      if (option != nullptr && option->semantic()->max_tokens() > 0) {
+        ++i;
+      }
+    } catch (const po::error&) {
+      // Ambiguous options are reported by the parser.
+    }
+  }
+  return argc;
+}
+
+// Reads KEY=VALUE lines from an env file. Empty lines and lines starting with
+// # are ignored.
+bool readEnvFile(const std::string& file, std::vector<std::string>& env) {
+  std::ifstream ifs(file);
+  if (!ifs.is_open()) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (!line.empty() && line[0] != '#') {
+      env.push_back(line);
+    }
+  }
+  return true;
+}
+
+// Sets an environment variable given as KEY=VALUE, or as KEY to take the
+// value from the agent's environment. A later value replaces an earlier one.
+bool setEnv(const std::string& var, std::vector<std::string>& env) {
+  std::string entry = var;
+  size_t eq = entry.find('=');
+  if (eq == 0) {
+    return false;
+  }
+  if (eq == std::string::npos) {
+    const char* value = getenv(entry.c_str());
+    if (value == nullptr) {
+      return true;
+    }
+    eq = entry.size();
+    entry += "=" + std::string(value);
+  }
+  const std::string key = entry.substr(0, eq + 1);
+  env.erase(
+      std::remove_if(
+          env.begin(),
+          env.end(),
+          [&key](const std::string& e) {
+            return e.compare(0, key.size(), key) == 0;
+          }),
+      env.end());
+  env.push_back(entry);
+  return true;
+}
+
+// Called in parent (agent) process.
+// Opens an executable in the container root the way execvp() would find it,
+// with PATH taken from the container's environment. rootfd is AT_FDCWD if the
+// container keeps the host root. Returns -1 if it's not found.
+int openExecutable(int rootfd, Command& command) {
+  const std::string& file = command.args[0];
+  std::vector<std::string> candidates;
+  if (file.find('/') != std::string::npos) {
+    candidates.push_back(file);
+  } else {
+    std::string path;
+    for (const auto& var : command.env) {
+      if (var.compare(0, 5, "PATH=") == 0) {
+        path = var.substr(5);
+      }
+    }
+    std::istringstream iss(path);
+    std::string dir;
+    while (std::getline(iss, dir, ':')) {
+      candidates.push_back((dir.empty() ? "." : dir) + "/" + file);
+    }
+  }
+  struct open_how how = {};
+  how.flags = O_PATH | O_CLOEXEC;
+  // Symlinks and ".." are resolved as if the container root was "/".
+  how.resolve = rootfd == AT_FDCWD ? 0 : RESOLVE_IN_ROOT;
+  for (const auto& candidate : candidates) {
+    int fd =
+        syscall(SYS_openat2, rootfd, candidate.c_str(), &how, sizeof(how));
+    if (fd == -1) {
+      continue;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+      command.path = candidate;
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+// Sends fds over a unix socket.
+bool sendFds(int sockfd, const int* fds, int count) {
+  char control[CMSG_SPACE(sizeof(int) * kMaxPassedFds)] = {};
+  char data = 0;
+  struct iovec iov = {&data, sizeof(data)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  return sendmsg(sockfd, &msg, 0) != -1;
+}
+
+// Receives exactly count fds sent with sendFds(), as close-on-exec fds.
+bool receiveFds(int sockfd, int* fds, int count) {
+  char control[CMSG_SPACE(sizeof(int) * kMaxPassedFds)] = {};
+  char data;
+  struct iovec iov = {&data, sizeof(data)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+    return false;
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+    return false;
+  }
+  const int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * std::min(received, count));
+  if (received == count) {
+    return true;
+  }
+  for (int i = 0; i < std::min(received, count); ++i) {
+    close(fds[i]);
+  }
+  return false;
+}
+
+#define SYSCALL(name) \
+  { #name, SYS_##name }
+// x86-64 syscalls by name, for seccomp profiles.
+const std::vector<std::pair<std::string, int>> kSyscalls = {
+    SYSCALL(read), SYSCALL(write), SYSCALL(open), SYSCALL(close), SYSCALL(stat),
+    SYSCALL(fstat), SYSCALL(lstat), SYSCALL(poll), SYSCALL(lseek),
+    SYSCALL(mmap), SYSCALL(mprotect), SYSCALL(munmap), SYSCALL(brk),
+    SYSCALL(rt_sigaction), SYSCALL(rt_sigprocmask), SYSCALL(rt_sigreturn),
+    SYSCALL(ioctl), SYSCALL(pread64), SYSCALL(pwrite64), SYSCALL(readv),
+    SYSCALL(writev), SYSCALL(access), SYSCALL(pipe), SYSCALL(select),
+    SYSCALL(sched_yield), SYSCALL(mremap), SYSCALL(msync), SYSCALL(mincore),
+    SYSCALL(madvise), SYSCALL(shmget), SYSCALL(shmat), SYSCALL(shmctl),
+    SYSCALL(dup), SYSCALL(dup2), SYSCALL(pause), SYSCALL(nanosleep),
+    SYSCALL(getitimer), SYSCALL(alarm), SYSCALL(setitimer), SYSCALL(getpid),
+    SYSCALL(sendfile), SYSCALL(socket), SYSCALL(connect), SYSCALL(accept),
+    SYSCALL(sendto), SYSCALL(recvfrom), SYSCALL(sendmsg), SYSCALL(recvmsg),
+    SYSCALL(shutdown), SYSCALL(bind), SYSCALL(listen), SYSCALL(getsockname),
+    SYSCALL(getpeername), SYSCALL(socketpair), SYSCALL(setsockopt),
+    SYSCALL(getsockopt), SYSCALL(clone), SYSCALL(fork), SYSCALL(vfork),
+    SYSCALL(execve), SYSCALL(exit), SYSCALL(wait4), SYSCALL(kill),
+    SYSCALL(uname), SYSCALL(semget), SYSCALL(semop), SYSCALL(semctl),
+    SYSCALL(shmdt), SYSCALL(msgget), SYSCALL(msgsnd), SYSCALL(msgrcv),
+    SYSCALL(msgctl), SYSCALL(fcntl), SYSCALL(flock), SYSCALL(fsync),
+    SYSCALL(fdatasync), SYSCALL(truncate), SYSCALL(ftruncate),
+    SYSCALL(getdents), SYSCALL(getcwd), SYSCALL(chdir), SYSCALL(fchdir),
+    SYSCALL(rename), SYSCALL(mkdir), SYSCALL(rmdir), SYSCALL(creat),
+    SYSCALL(link), SYSCALL(unlink), SYSCALL(symlink), SYSCALL(readlink),
+    SYSCALL(chmod), SYSCALL(fchmod), SYSCALL(chown), SYSCALL(fchown),
+    SYSCALL(lchown), SYSCALL(umask), SYSCALL(gettimeofday), SYSCALL(getrlimit),
+    SYSCALL(getrusage), SYSCALL(sysinfo), SYSCALL(times), SYSCALL(ptrace),
+    SYSCALL(getuid), SYSCALL(syslog), SYSCALL(getgid), SYSCALL(setuid),
+    SYSCALL(setgid), SYSCALL(geteuid), SYSCALL(getegid), SYSCALL(setpgid),
+    SYSCALL(getppid), SYSCALL(getpgrp), SYSCALL(setsid), SYSCALL(setreuid),
+    SYSCALL(setregid), SYSCALL(getgroups), SYSCALL(setgroups),
+    SYSCALL(setresuid), SYSCALL(getresuid), SYSCALL(setresgid),
+    SYSCALL(getresgid), SYSCALL(getpgid), SYSCALL(setfsuid), SYSCALL(setfsgid),
+    SYSCALL(getsid), SYSCALL(capget), SYSCALL(capset), SYSCALL(rt_sigpending),
+    SYSCALL(rt_sigtimedwait), SYSCALL(rt_sigqueueinfo), SYSCALL(rt_sigsuspend),
+    SYSCALL(sigaltstack), SYSCALL(utime), SYSCALL(mknod), SYSCALL(uselib),
+    SYSCALL(personality), SYSCALL(ustat), SYSCALL(statfs), SYSCALL(fstatfs),
+    SYSCALL(sysfs), SYSCALL(getpriority), SYSCALL(setpriority),
+    SYSCALL(sched_setparam), SYSCALL(sched_getparam),
+    SYSCALL(sched_setscheduler), SYSCALL(sched_getscheduler),
+    SYSCALL(sched_get_priority_max), SYSCALL(sched_get_priority_min),
+    SYSCALL(sched_rr_get_interval), SYSCALL(mlock), SYSCALL(munlock),
+    SYSCALL(mlockall), SYSCALL(munlockall), SYSCALL(vhangup),
+    SYSCALL(modify_ldt), SYSCALL(pivot_root), SYSCALL(_sysctl), SYSCALL(prctl),
+    SYSCALL(arch_prctl), SYSCALL(adjtimex), SYSCALL(setrlimit), SYSCALL(chroot),
+    SYSCALL(sync), SYSCALL(acct), SYSCALL(settimeofday), SYSCALL(mount),
+    SYSCALL(umount2), SYSCALL(swapon), SYSCALL(swapoff), SYSCALL(reboot),
+    SYSCALL(sethostname), SYSCALL(setdomainname), SYSCALL(iopl),
+    SYSCALL(ioperm), SYSCALL(create_module), SYSCALL(init_module),
+    SYSCALL(delete_module), SYSCALL(get_kernel_syms), SYSCALL(query_module),
+    SYSCALL(quotactl), SYSCALL(nfsservctl), SYSCALL(getpmsg), SYSCALL(putpmsg),
+    SYSCALL(afs_syscall), SYSCALL(tuxcall), SYSCALL(security), SYSCALL(gettid),
+    SYSCALL(readahead), SYSCALL(setxattr), SYSCALL(lsetxattr),
+    SYSCALL(fsetxattr), SYSCALL(getxattr), SYSCALL(lgetxattr),
+    SYSCALL(fgetxattr), SYSCALL(listxattr), SYSCALL(llistxattr),
+    SYSCALL(flistxattr), SYSCALL(removexattr), SYSCALL(lremovexattr),
+    SYSCALL(fremovexattr), SYSCALL(tkill), SYSCALL(time), SYSCALL(futex),
+    SYSCALL(sched_setaffinity), SYSCALL(sched_getaffinity),
+    SYSCALL(set_thread_area), SYSCALL(io_setup), SYSCALL(io_destroy),
+    SYSCALL(io_getevents), SYSCALL(io_submit), SYSCALL(io_cancel),
+    SYSCALL(get_thread_area), SYSCALL(lookup_dcookie), SYSCALL(epoll_create),
+    SYSCALL(epoll_ctl_old), SYSCALL(epoll_wait_old), SYSCALL(remap_file_pages),
+    SYSCALL(getdents64), SYSCALL(set_tid_address), SYSCALL(restart_syscall),
+    SYSCALL(semtimedop), SYSCALL(fadvise64), SYSCALL(timer_create),
+    SYSCALL(timer_settime), SYSCALL(timer_gettime), SYSCALL(timer_getoverrun),
+    SYSCALL(timer_delete), SYSCALL(clock_settime), SYSCALL(clock_gettime),
+    SYSCALL(clock_getres), SYSCALL(clock_nanosleep), SYSCALL(exit_group),
+    SYSCALL(epoll_wait), SYSCALL(epoll_ctl), SYSCALL(tgkill), SYSCALL(utimes),
+    SYSCALL(vserver), SYSCALL(mbind), SYSCALL(set_mempolicy),
+    SYSCALL(get_mempolicy), SYSCALL(mq_open), SYSCALL(mq_unlink),
+    SYSCALL(mq_timedsend), SYSCALL(mq_timedreceive), SYSCALL(mq_notify),
+    SYSCALL(mq_getsetattr), SYSCALL(kexec_load), SYSCALL(waitid),
+    SYSCALL(add_key), SYSCALL(request_key), SYSCALL(keyctl),
+    SYSCALL(ioprio_set), SYSCALL(ioprio_get), SYSCALL(inotify_init),
+    SYSCALL(inotify_add_watch), SYSCALL(inotify_rm_watch),
+    SYSCALL(migrate_pages), SYSCALL(openat), SYSCALL(mkdirat), SYSCALL(mknodat),
+    SYSCALL(fchownat), SYSCALL(futimesat), SYSCALL(newfstatat),
+    SYSCALL(unlinkat), SYSCALL(renameat), SYSCALL(linkat), SYSCALL(symlinkat),
+    SYSCALL(readlinkat), SYSCALL(fchmodat), SYSCALL(faccessat),
+    SYSCALL(pselect6), SYSCALL(ppoll), SYSCALL(unshare),
+    SYSCALL(set_robust_list), SYSCALL(get_robust_list), SYSCALL(splice),
+    SYSCALL(tee), SYSCALL(sync_file_range), SYSCALL(vmsplice),
+    SYSCALL(move_pages), SYSCALL(utimensat), SYSCALL(epoll_pwait),
+    SYSCALL(signalfd), SYSCALL(timerfd_create), SYSCALL(eventfd),
+    SYSCALL(fallocate), SYSCALL(timerfd_settime), SYSCALL(timerfd_gettime),
+    SYSCALL(accept4), SYSCALL(signalfd4), SYSCALL(eventfd2),
+    SYSCALL(epoll_create1), SYSCALL(dup3), SYSCALL(pipe2),
+    SYSCALL(inotify_init1), SYSCALL(preadv), SYSCALL(pwritev),
+    SYSCALL(rt_tgsigqueueinfo), SYSCALL(perf_event_open), SYSCALL(recvmmsg),
+    SYSCALL(fanotify_init), SYSCALL(fanotify_mark), SYSCALL(prlimit64),
+    SYSCALL(name_to_handle_at), SYSCALL(open_by_handle_at),
+    SYSCALL(clock_adjtime), SYSCALL(syncfs), SYSCALL(sendmmsg), SYSCALL(setns),
+    SYSCALL(getcpu), SYSCALL(process_vm_readv), SYSCALL(process_vm_writev),
+    SYSCALL(kcmp), SYSCALL(finit_module), SYSCALL(sched_setattr),
+    SYSCALL(sched_getattr), SYSCALL(renameat2), SYSCALL(seccomp),
+    SYSCALL(getrandom), SYSCALL(memfd_create), SYSCALL(kexec_file_load),
+    SYSCALL(bpf), SYSCALL(execveat), SYSCALL(userfaultfd), SYSCALL(membarrier),
+    SYSCALL(mlock2), SYSCALL(copy_file_range), SYSCALL(preadv2),
+    SYSCALL(pwritev2), SYSCALL(pkey_mprotect), SYSCALL(pkey_alloc),
+    SYSCALL(pkey_free), SYSCALL(statx), SYSCALL(io_pgetevents), SYSCALL(rseq),
+    SYSCALL(pidfd_send_signal), SYSCALL(io_uring_setup),
+    SYSCALL(io_uring_enter), SYSCALL(io_uring_register), SYSCALL(open_tree),
+    SYSCALL(move_mount), SYSCALL(fsopen), SYSCALL(fsconfig), SYSCALL(fsmount),
+    SYSCALL(fspick), SYSCALL(pidfd_open), SYSCALL(clone3), SYSCALL(close_range),
+    SYSCALL(openat2), SYSCALL(pidfd_getfd), SYSCALL(faccessat2),
+    SYSCALL(process_madvise), SYSCALL(epoll_pwait2), SYSCALL(mount_setattr),
+    SYSCALL(quotactl_fd), SYSCALL(landlock_create_ruleset),
+    SYSCALL(landlock_add_rule), SYSCALL(landlock_restrict_self),
+    SYSCALL(memfd_secret), SYSCALL(process_mrelease), SYSCALL(futex_waitv),
+    SYSCALL(set_mempolicy_home_node)
+};
+#undef SYSCALL
+
+// The number of the most frequent allowed syscalls of a seccomp profile that
+// are checked one by one, before the binary search over the rest.
+const size_t kHotSyscalls = 8;
+
+// A rule of a seccomp profile. count is how often the syscall was made when
+// the profile was recorded.
+struct SeccompRule {
+  int nr;
+  uint32_t action;
+  uint64_t count;
+};
+
+// A seccomp profile, read from a file of lines
+//   default allow|kill|errno N
+//   allow|deny|kill|errno N SYSCALL [COUNT]
+// where deny fails the syscall with EPERM. Empty lines and lines starting
+// with # are ignored.
+struct SeccompProfile {
+  uint32_t defaultAction;
+  std::vector<SeccompRule> rules;
+  SeccompProfile() : defaultAction(SECCOMP_RET_KILL_PROCESS) {}
+};
+
+// Returns the number of a syscall given by name or number, or -1.
+int getSyscallNumber(const std::string& name) {
+  for (const auto& syscall : kSyscalls) {
+    if (syscall.first == name) {
+      return syscall.second;
+    }
+  }
+  if (!name.empty() &&
+      name.find_first_not_of("0123456789") == std::string::npos) {
+    return std::stoi(name);
+  }
+  return -1;
+}
+
+std::string getSyscallName(int nr) {
+  for (const auto& syscall : kSyscalls) {
+    if (syscall.second == nr) {
+      return syscall.first;
+    }
+  }
+  return std::to_string(nr);
+}
+
+bool parseSeccompAction(
+    const std::string& word,
+    std::istringstream& iss,
+    uint32_t& action) {
+  if (word == "allow") {
+    action = SECCOMP_RET_ALLOW;
+  } else if (word == "kill") {
+    action = SECCOMP_RET_KILL_PROCESS;
+  } else if (word == "deny") {
+    action = SECCOMP_RET_ERRNO | EPERM;
+  } else if (word == "errno") {
+    int err = -1;
+    if (!(iss >> err) || err < 0 ||
+        static_cast<uint32_t>(err) > SECCOMP_RET_DATA) {
+      return false;
+    }
+    action = SECCOMP_RET_ERRNO | err;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool readSeccompProfile(const std::string& file, SeccompProfile& profile) {
+  std::ifstream ifs(file);
+  if (!ifs.is_open()) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::string word;
+    if (!(iss >> word) || word[0] == '#') {
+      continue;
+    }
+    if (word == "default") {
+      if (!(iss >> word) ||
+          !parseSeccompAction(word, iss, profile.defaultAction)) {
+        return false;
+      }
+      continue;
+    }
+    SeccompRule rule = {-1, 0, 0};
+    std::string name;
+    if (!parseSeccompAction(word, iss, rule.action) || !(iss >> name)) {
+      return false;
+    }
+    rule.nr = getSyscallNumber(name);
+    if (rule.nr == -1) {
+      std::cerr << "Error: Unknown syscall " << name << std::endl;
+      return false;
+    }
+    iss >> rule.count;
+    profile.rules.push_back(rule);
+  }
+  return true;
+}
+
+// Loads the syscall number, after checking the architecture. x32 syscalls
+// share the x86-64 numbers with a flag bit set, so they are rejected too.
+std::vector<struct sock_filter> getSeccompPrologue() {
+  return {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS)};
+}
+
+// Emits a binary search over ranges of syscall numbers, where range i starts
+// at ranges[i].first and ends where range i + 1 starts.
+std::vector<struct sock_filter> compileSyscallSearch(
+    const std::vector<std::pair<uint32_t, uint32_t>>& ranges,
+    size_t begin,
+    size_t end) {
+  if (end - begin == 1) {
+    return {BPF_STMT(BPF_RET | BPF_K, ranges[begin].second)};
+  }
+  size_t mid = begin + (end - begin) / 2;
+  std::vector<struct sock_filter> left =
+      compileSyscallSearch(ranges, begin, mid);
+  std::vector<struct sock_filter> right =
+      compileSyscallSearch(ranges, mid, end);
+  std::vector<struct sock_filter> code;
+  if (left.size() <= 255) {
+    code.push_back(BPF_JUMP(
+        BPF_JMP | BPF_JGE | BPF_K,
+        ranges[mid].first,
+        static_cast<uint8_t>(left.size()),
+        0));
+  } else {
+    // Conditional jumps only reach 255 instructions ahead.
+    code.push_back(
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, ranges[mid].first, 0, 1));
+    code.push_back(
+        BPF_STMT(BPF_JMP | BPF_JA, static_cast<uint32_t>(left.size())));
+  }
+  code.insert(code.end(), left.begin(), left.end());
+  code.insert(code.end(), right.begin(), right.end());
+  return code;
+}
+
+// Compiles a seccomp profile into a filter that checks the most frequent
+// allowed syscalls first, so that they match in a few instructions, and finds
+// the action of any other syscall with a binary search.
+std::vector<struct sock_filter> compileSeccompProfile(
+    const SeccompProfile& profile) {
+  std::vector<struct sock_filter> code = getSeccompPrologue();
+  // Later rules override earlier ones.
+  std::map<uint32_t, uint32_t> actions;
+  std::map<uint32_t, uint64_t> counts;
+  for (const auto& rule : profile.rules) {
+    actions[rule.nr] = rule.action;
+    counts[rule.nr] = std::max(counts[rule.nr], rule.count);
+  }
+
+  // (1) The hottest allowed syscalls jump to a shared return.
+  std::vector<SeccompRule> hot;
+  for (const auto& action : actions) {
+    if (action.second == SECCOMP_RET_ALLOW && counts[action.first] > 0) {
+      hot.push_back({static_cast<int>(action.first),
+                     action.second,
+                     counts[action.first]});
+    }
+  }
+  std::sort(
+      hot.begin(),
+      hot.end(),
+      [](const SeccompRule& a, const SeccompRule& b) {
+        return a.count > b.count;
+      });
+  hot.resize(std::min(hot.size(), kHotSyscalls));
+  for (size_t i = 0; i < hot.size(); ++i) {
+    code.push_back(BPF_JUMP(
+        BPF_JMP | BPF_JEQ | BPF_K,
+        static_cast<uint32_t>(hot[i].nr),
+        static_cast<uint8_t>(hot.size() - i),
+        0));
+  }
+  if (!hot.empty()) {
+    code.push_back(BPF_STMT(BPF_JMP | BPF_JA, 1));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+  }
+
+  // (2) Split the syscall numbers into ranges of the same action.
+  std::vector<std::pair<uint32_t, uint32_t>> ranges = {
+      {0, profile.defaultAction}};
+  for (const auto& action : actions) {
+    if (ranges.back().first == action.first) {
+      ranges.back().second = action.second;
+    } else if (ranges.back().second != action.second) {
+      ranges.push_back(action);
+    }
+    if (!actions.count(action.first + 1) &&
+        action.second != profile.defaultAction) {
+      ranges.push_back({action.first + 1, profile.defaultAction});
+    }
+  }
+
+  // (3) Binary search over the ranges.
+  std::vector<struct sock_filter> search =
+      compileSyscallSearch(ranges, 0, ranges.size());
+  code.insert(code.end(), search.begin(), search.end());
+  return code;
+}
+
+// Builds the filter of --seccomp-record, which passes every syscall to the
+// agent, except for the sendmsg() on sockfd that sends the agent the listener.
+std::vector<struct sock_filter> getSeccompRecordFilter(int sockfd) {
+  std::vector<struct sock_filter> code = getSeccompPrologue();
+  std::vector<struct sock_filter> record = {
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_sendmsg, 0, 3),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args)),
+      BPF_JUMP(
+          BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(sockfd), 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF)};
+  code.insert(code.end(), record.begin(), record.end());
+  return code;
+}
+
+// Called in parent (agent) process, on its own thread.
+// Receives the seccomp listener of the container and lets every syscall of
+// the container continue, counting them. Returns once all processes of the
+// container have exited.
+std::map<int, uint64_t> recordSyscalls(int sockfd) {
+  std::map<int, uint64_t> counts;
+  int listener;
+  bool received = receiveFds(sockfd, &listener, 1);
+  close(sockfd);
+  if (!received) {
+    return counts;
+  }
+
+  struct pollfd pfd = {listener, POLLIN, 0};
+  for (;;) {
+    if (poll(&pfd, 1, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (pfd.revents & POLLHUP) {
+      break;
+    }
+    struct seccomp_notif req = {};
+    if (ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, &req) == -1) {
+      continue;
+    }
+    ++counts[req.data.nr];
+    struct seccomp_notif_resp resp = {};
+    resp.id = req.id;
+    resp.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+    // Fails with ENOENT if the process was killed in the meantime.
+    ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, &resp);
+  }
+  close(listener);
+  return counts;
+}
+
+// Writes a profile that allows the recorded syscalls, most frequent first.
+bool writeSeccompProfile(
+    const std::string& file,
+    const std::map<int, uint64_t>& counts) {
+  std::vector<std::pair<int, uint64_t>> sorted(counts.begin(), counts.end());
+  std::sort(
+      sorted.begin(),
+      sorted.end(),
+      [](const std::pair<int, uint64_t>& a,
+         const std::pair<int, uint64_t>& b) { return a.second > b.second; });
+  std::ostringstream oss;
+  oss << "default errno " << EPERM << std::endl;
+  for (const auto& count : sorted) {
+    oss << "allow " << getSyscallName(count.first) << " " << count.second
+        << std::endl;
+  }
+  std::ofstream ofs(file);
+  ofs << oss.str();
+  return ofs.good();
+}
+
+// Called in child (container) process, right before exec.
+void installSeccompFilter(const Command& command) {
+  struct sock_fprog prog = {
+      static_cast<unsigned short>(command.seccompFilter.size()),
+      const_cast<struct sock_filter*>(command.seccompFilter.data())};
+  const unsigned int flags =
+      command.seccompSocket != -1 ? SECCOMP_FILTER_FLAG_NEW_LISTENER : 0;
+  int ret = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, flags, &prog);
+  if (ret == -1 && errno == EACCES) {
+    // Without CAP_SYS_ADMIN, a filter is only allowed if setuid binaries
+    // can't gain privileges that the filter doesn't expect.
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+      errExit("prctl(PR_SET_NO_NEW_PRIVS)");
+    }
+    ret = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, flags, &prog);
+  }
+  if (ret == -1) {
+    errExit("seccomp(SECCOMP_SET_MODE_FILTER)");
+  }
+  if (command.seccompSocket == -1) {
+    return;
+  }
+  // Send the listener to the agent. From here on, every syscall waits for
+  // the agent to let it continue.
+  if (!sendFds(command.seccompSocket, &ret, 1)) {
+    errExit("sendmsg(seccomp listener)");
+  }
+  close(ret);
+  close(command.seccompSocket);
+}
+
 std::string getHostname() {
   char hostname[HOST_NAME_MAX];
   if (gethostname(hostname, HOST_NAME_MAX) != 0) {
@@ -47,263 +860,5168 @@ std::string getNisDomainName() {
   return std::string(domainname);
 }
 
-void runContainer(const std::string& cmd) {
-  std::istringstream iss(cmd);
-  std::vector<std::string> tokens{std::istream_iterator<std::string>{iss},
-                                  std::istream_iterator<std::string>{}};
-  std::vector<char*> args;
-
-  for (const auto& arg : tokens) {
-    args.push_back(const_cast<char*>(arg.c_str()));
-  }
-  args.push_back(nullptr);
-
+void runContainer(const Command& command) {
   if (verbose) {
-    std::cout << "[Container] Running command: " << cmd << std::endl;
+    std::cout << "[Container] Running command:";
+    for (const auto& arg : command.args) {
+      std::cout << " " << arg;
+    }
+    std::cout << std::endl;
     std::cout << "[Container] Container hostname: " << getHostname()
               << std::endl;
     std::cout << "[Container] Container NIS domain name: "
               << getNisDomainName() << std::endl;
-    execv(tokens[0].c_str(), args.data());
   }
 
-  errExit("execv failed");  // Only reached if execv() fails
+  if (command.ttyFd != -1) {
+    // Under --init, the command is already a session leader.
+    if ((setsid() == -1 && errno != EPERM) ||
+        ioctl(command.ttyFd, TIOCSCTTY, 0) == -1 ||
+        dup2(command.ttyFd, STDIN_FILENO) == -1 ||
+        dup2(command.ttyFd, STDOUT_FILENO) == -1 ||
+        dup2(command.ttyFd, STDERR_FILENO) == -1) {
+      errExit("TIOCSCTTY");
+    }
+  }
+  if (command.stdoutFd != -1 && (dup2(command.stdoutFd, STDOUT_FILENO) == -1 ||
+                                 dup2(command.stderrFd, STDERR_FILENO) == -1)) {
+    errExit("dup2(log pipe)");
+  }
+  if (!command.seccompFilter.empty()) {
+    installSeccompFilter(command);
+  }
+  execveat(
+      command.fd,
+      "",
+      command.argv.data(),
+      command.envp.data(),
+      AT_EMPTY_PATH);
+  // A script can't be run from a close-on-exec fd, since its interpreter
+  // opens it by path.
+  if (errno == ENOENT) {
+    execve(command.path.c_str(), command.argv.data(), command.envp.data());
+  }
+
+  errExit("execve failed");  // Only reached if execve() fails
 }
 
-void setupFilesystem(const std::string& rootfs) {
-  if (rootfs.empty()) {
-    return;
+// Called in child (container) process.
+// A minimal init that stays as PID 1 of the container. It runs the command in
+// its own process group, forwards signals to that group, reaps every process
+// orphaned into the container and exits with the status of the command.
+void runInit(const Command& command) {
+  // Synchronous signals are about init itself and can't be forwarded.
+  sigset_t mask;
+  sigset_t oldMask;
+  sigfillset(&mask);
+  for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGTRAP, SIGSYS}) {
+    sigdelset(&mask, sig);
   }
-  // (1) Create a new namespace
-  if (unshare(CLONE_NEWNS) == -1) {
-    errExit("unshare(CLONE_NEWNS)");
+  if (sigprocmask(SIG_BLOCK, &mask, &oldMask) == -1) {
+    errExit("sigprocmask");
   }
-  // (2) Change the propagation type of all mount points to MS_SLAVE.
-  // Equivalent to "mount --make-rslave /"
-  if (mount(
-        "" /* source: IGNORED */,
-        "/" /* target */,
-        nullptr /* filesystemtype: IGNORED*/,
-        MS_SLAVE | MS_REC /* mountflags */,
-        nullptr /* data: IGNORED*/) == -1) {
-    errExit("mount(/, MS_SLAVE | MS_REC)");
+  int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sigfd == -1) {
+    errExit("signalfd");
   }
-
-  // (3) Bind mount rootfs to itself so that it becomes a mount point.
-  // Because the source of a mount move must be a mount point.
-  if (mount(
-        rootfs.c_str() /* source */,
-        rootfs.c_str() /* target */,
-        nullptr /* filesystemtype: IGNORED*/,
-        MS_BIND | MS_REC /* mountflags */,
-        nullptr /* data: IGNORED*/) == -1) {
-    errExit("mount(rootfs, rootfs, MS_BIND | MS_REC)");
+  // Without a PID namespace, orphans of the command are still reaped here.
+  if (getpid() != 1 && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+    errExit("prctl(PR_SET_CHILD_SUBREAPER)");
   }
 
-  // (4) Enter rootfs
-  if (chdir(rootfs.c_str()) == -1) {
-    errExit("chdir(rootfs)");
+  pid_t child = fork();
+  if (child == -1) {
+    errExit("fork");
   }
-  // (5) Mount move rootfs to "/".
-  if (mount(
-        rootfs.c_str() /* source */,
-        "/" /* target */,
-        nullptr /* filesystemtype: IGNORED*/,
-        MS_MOVE /* mountflags */,
-        nullptr /* data: IGNORED*/) == -1) {
-    errExit("mount(rootfs, /, MS_MOVE)");
+  if (child == 0) {
+    // A session of its own to get the pty as its controlling terminal.
+    if (command.ttyFd != -1) {
+      setsid();
+    } else {
+      setpgid(0, 0);
+    }
+    if (sigprocmask(SIG_SETMASK, &oldMask, nullptr) == -1) {
+      errExit("sigprocmask");
+    }
+    runContainer(command);
   }
-  // (6) Change the container's root to rootfs
-  if (chroot(".") == -1) {
-    errExit("chroot(\".\")");
+  // Also set by the child, so that a signal that arrives first finds it.
+  if (command.ttyFd == -1) {
+    setpgid(child, child);
   }
-  // (7) Change current directory to "/"
-  if (chdir("/") == -1) {
-    errExit("chdir(\"/\")");
+
+  for (;;) {
+    struct signalfd_siginfo info;
+    if (read(sigfd, &info, sizeof(info)) != sizeof(info)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      errExit("read(signalfd)");
+    }
+    if (info.ssi_signo != SIGCHLD) {
+      if (kill(-child, info.ssi_signo) == -1) {
+        kill(child, info.ssi_signo);
+      }
+      continue;
+    }
+    // SIGCHLD is coalesced, so reap until there is nothing left.
+    siginfo_t status;
+    for (;;) {
+      status.si_pid = 0;
+      if (waitid(P_ALL, 0, &status, WEXITED | WNOHANG) == -1 ||
+          status.si_pid == 0) {
+        break;
+      }
+      if (status.si_pid == child) {
+        // In a PID namespace, the kernel kills the rest of the container
+        // when this, its PID 1, exits. Without --pid, the remaining
+        // processes are reparented to the host's init and keep running.
+        exit(status.si_code == CLD_EXITED ? status.si_status
+                                          : 128 + status.si_status);
+      }
+    }
   }
-  // (8) Let any changes in the container propagae to its children if any
-  if (mount(
-        "" /* source: IGNORED */,
-        "/" /* target */,
-        nullptr /* filesystemtype: IGNORED*/,
-        MS_SHARED | MS_REC /* mountflags */,
-        nullptr /* data: IGNORED*/) == -1) {
-    errExit("mount(/, MS_SHARED | MS_REC)");
+}
+
+// Returns the filesystem type of a rootfs image file based on the magic number
+// in its superblock, or an empty string if it's not a supported image.
+std::string getImageFsType(const std::string& image) {
+  int fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    errExit("open(image)");
   }
-  // (9) Mount procfs for the container
-  if (mount(
-        "proc" /* source */,
-        "/proc" /* target */,
-        "proc" /* filesystemtype */,
-        MS_NOSUID | MS_NOEXEC | MS_NODEV /* mountflags */,
-        nullptr /* data: IGNORED*/) == -1) {
-    errExit("mount(proc, /proc, MS_NOSUID | MS_NOEXEC | MS_NODEV)");
+  std::string fsType;
+  uint32_t magic = 0;
+  if (pread(fd, &magic, sizeof(magic), kErofsMagicOffset) == sizeof(magic) &&
+      magic == kErofsMagic) {
+    fsType = kErofsType;
+  } else if (
+      pread(fd, &magic, sizeof(magic), kSquashfsMagicOffset) ==
+          sizeof(magic) &&
+      magic == kSquashfsMagic) {
+    fsType = kSquashfsType;
   }
+  close(fd);
+  return fsType;
 }
 
-void setHostAndDomainName(
-    const std::string& hostname,
-    const std::string& nisDomainName) {
-  if (!hostname.empty() &&
-      sethostname(hostname.c_str(), hostname.length()) != 0) {
-    errExit("sethostname");
+std::string readFirstLine(const std::string& file) {
+  std::ifstream ifs(file);
+  std::string line;
+  std::getline(ifs, line);
+  return line;
+}
+
+// Looks for a read-only loop device that another container has already
+// attached to the same image. Sharing the device means all containers of an
+// image mount the same filesystem and therefore share its page cache.
+std::string findPooledLoopDevice(const std::string& imagePath) {
+  DIR* dir = opendir("/sys/block");
+  if (dir == nullptr) {
+    return "";
   }
-  if (!nisDomainName.empty() &&
-      setdomainname(nisDomainName.c_str(), nisDomainName.length()) != 0) {
-    errExit("setdomainname");
+  std::string device;
+  while (struct dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.compare(0, 4, "loop") != 0) {
+      continue;
+    }
+    const std::string sysPath = "/sys/block/" + name;
+    if (readFirstLine(sysPath + "/loop/backing_file") == imagePath &&
+        readFirstLine(sysPath + "/loop/autoclear") == "1" &&
+        readFirstLine(sysPath + "/ro") == "1") {
+      device = "/dev/" + name;
+      break;
+    }
   }
+  closedir(dir);
+  return device;
 }
 
 // Called in parent (agent) process.
-void prepareNetwork(int containerPid) {
-  // (1) Create the default bridge if it doesn't exist.
-  std::string cmd = "ip link add name " + kDefaultBridgeName + " type bridge";
-  system(cmd.c_str());
+// Attaches the rootfs image to a loop device, reusing a pooled one if possible.
+// Returns an open fd of the loop device.
+int attachLoopDevice(const std::string& image, std::string& device) {
+  char imagePath[PATH_MAX];
+  if (realpath(image.c_str(), imagePath) == nullptr) {
+    errExit("realpath(image)");
+  }
 
-  // (2) Make sure the bridge is up.
-  cmd = "ip link set " + kDefaultBridgeName + " up";
-  if (system(cmd.c_str()) != 0) {
-    errExit("setting default bridge up failed");
+  // (1) Reuse the loop device of another container running the same image
+  device = findPooledLoopDevice(imagePath);
+  if (!device.empty()) {
+    int loopfd = open(device.c_str(), O_RDONLY | O_CLOEXEC);
+    if (loopfd != -1) {
+      return loopfd;
+    }
+    // The device may have been auto-cleared in the meantime.
   }
 
-  // (3) Add IP to the bridge if it doesn't exist.
-  cmd = "ip addr add " + kDefaultBridgeIp + "/" + kDefaultBridgePrefixLen +
-        " brd + dev " + kDefaultBridgeName;
-  system(cmd.c_str());
+  int ctlfd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  if (ctlfd == -1) {
+    errExit("open(/dev/loop-control)");
+  }
+  int backingfd = open(imagePath, O_RDONLY | O_CLOEXEC);
+  if (backingfd == -1) {
+    errExit("open(image)");
+  }
 
-  // (4) Create a veth pair between host and container
-  // The veth interface name on the host is int the format "veth<container_pid>"
-  const std::string vethName = "veth" + std::to_string(containerPid);
-  cmd = "ip link add " + vethName + " type veth peer name eth0 netns " +
-        std::to_string(containerPid);
-  if (system(cmd.c_str()) != 0) {
-    errExit("adding veth pair failed");
+  struct loop_config config = {};
+  config.fd = backingfd;
+  // Direct I/O avoids caching the image twice: once for the image file and
+  // once for the filesystem mounted from the loop device.
+  config.info.lo_flags =
+      LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+  strncpy(
+      reinterpret_cast<char*>(config.info.lo_file_name),
+      imagePath,
+      LO_NAME_SIZE - 1);
+
+  int loopfd = -1;
+  while (loopfd == -1) {
+    // (2) Get a free loop device
+    int nr = ioctl(ctlfd, LOOP_CTL_GET_FREE);
+    if (nr == -1) {
+      errExit("ioctl(LOOP_CTL_GET_FREE)");
+    }
+    device = "/dev/loop" + std::to_string(nr);
+    loopfd = open(device.c_str(), O_RDWR | O_CLOEXEC);
+    if (loopfd == -1) {
+      errExit("open(loop device)");
+    }
+
+    // (3) Attach the image and configure the device in a single call
+    if (ioctl(loopfd, LOOP_CONFIGURE, &config) == 0) {
+      break;
+    }
+    if (errno == EINVAL && (config.info.lo_flags & LO_FLAGS_DIRECT_IO)) {
+      // The backing filesystem doesn't support direct I/O. Fall back to
+      // buffered I/O.
+      config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+    } else if (errno != EBUSY) {
+      // EBUSY means another process grabbed the device first.
+      errExit("ioctl(LOOP_CONFIGURE)");
+    }
+    close(loopfd);
+    loopfd = -1;
   }
 
-  // (5) Bring up the veth interface
-  cmd = "ip link set " + vethName + " up";
-  if (system(cmd.c_str()) != 0) {
-    errExit("setting veth up failed");
+  close(backingfd);
+  close(ctlfd);
+  return loopfd;
+}
+
+// Creates a detached mount of a new filesystem instance. Parameters with an
+// empty value are set as flags.
+int mountDetached(
+    const std::string& fsType,
+    const std::vector<std::pair<std::string, std::string>>& params,
+    unsigned int attrs) {
+  int fsfd = fsopen(fsType.c_str(), FSOPEN_CLOEXEC);
+  if (fsfd == -1) {
+    errExit("fsopen");
+  }
+  for (const auto& param : params) {
+    int ret = param.second.empty()
+        ? fsconfig(fsfd, FSCONFIG_SET_FLAG, param.first.c_str(), nullptr, 0)
+        : fsconfig(
+              fsfd,
+              FSCONFIG_SET_STRING,
+              param.first.c_str(),
+              param.second.c_str(),
+              0);
+    if (ret == -1) {
+      errExit("fsconfig");
+    }
+  }
+  if (fsconfig(fsfd, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) == -1) {
+    errExit("fsconfig(FSCONFIG_CMD_CREATE)");
   }
+  int mntfd = fsmount(fsfd, FSMOUNT_CLOEXEC, attrs);
+  if (mntfd == -1) {
+    errExit("fsmount");
+  }
+  close(fsfd);
+  return mntfd;
+}
 
-  // (6) Add the veth interface as a port of the bridge
-  cmd = "ip link set " + vethName + " master " + kDefaultBridgeName;
-  if (system(cmd.c_str()) != 0) {
-    errExit("adding veth to bridge failed");
+// Called in parent (agent) process.
+// Builds the mount tree of the container root as a detached mount, so that the
+// container only needs to attach it. Returns the fd of the mount tree.
+int buildRootfsTree(const std::string& rootfs, const RootfsImage& image) {
+  if (!image.device.empty()) {
+    // An image is mounted from its loop device.
+    return mountDetached(
+        image.fsType,
+        {{"source", image.device}, {"ro", ""}},
+        MOUNT_ATTR_RDONLY | MOUNT_ATTR_NODEV);
   }
+  // A directory is cloned recursively, like a recursive bind mount.
+  int treefd = open_tree(
+      AT_FDCWD,
+      rootfs.c_str(),
+      OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+  if (treefd == -1) {
+    errExit("open_tree(rootfs, OPEN_TREE_CLONE | AT_RECURSIVE)");
+  }
+  // The clone is a peer of the host mount if that is shared. Make it a slave
+  // so that the mounts of the container don't propagate to the host, and so
+  // that it can be pivoted to.
+  struct mount_attr attr = {};
+  attr.propagation = MS_SLAVE;
+  if (mount_setattr(
+        treefd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr)) ==
+      -1) {
+    errExit("mount_setattr(rootfs, MS_SLAVE)");
+  }
+  return treefd;
+}
 
-  // (7) Enable IP forwarding
-  cmd = "sysctl -w net.ipv4.ip_forward=1";
-  if (system(cmd.c_str()) != 0) {
-    errExit("enabling net.ipv4.ip_forward failed");
+// Called in child (container) process.
+// Puts a tmpfs overlay on top of the rootfs mount tree, or of a directory of
+// it, so that writes go to memory and are discarded with the container.
+// Returns the fd of the overlay mount tree.
+int mountOverlay(int lowerfd) {
+  // Overlayfs only takes layers attached to the mount namespace, so they are
+  // assembled on a temporary directory.
+  char stagingDir[] = "/tmp/mini_container.XXXXXX";
+  if (mkdtemp(stagingDir) == nullptr) {
+    errExit("mkdtemp");
+  }
+  if (mount(
+        "tmpfs" /* source */,
+        stagingDir /* target */,
+        "tmpfs" /* filesystemtype */,
+        0 /* mountflags */,
+        "mode=0755" /* data */) == -1) {
+    errExit("mount(tmpfs, stagingDir)");
+  }
+  const std::string dir = stagingDir;
+  const std::string lower = dir + "/lower";
+  const std::string upper = dir + "/upper";
+  const std::string work = dir + "/work";
+  const std::string merged = dir + "/merged";
+  for (const auto& path : {lower, upper, work, merged}) {
+    if (mkdir(path.c_str(), 0755) == -1) {
+      errExit("mkdir(overlay dir)");
+    }
+  }
+  // The root of the overlay shows the owner and mode of the upper directory.
+  struct stat st;
+  if (fstat(lowerfd, &st) == -1 ||
+      chown(upper.c_str(), st.st_uid, st.st_gid) == -1 ||
+      chmod(upper.c_str(), st.st_mode & 07777) == -1) {
+    errExit("chown(upper)");
   }
+  if (move_mount(
+        lowerfd, "", AT_FDCWD, lower.c_str(), MOVE_MOUNT_F_EMPTY_PATH) ==
+      -1) {
+    errExit("move_mount(rootfs, lower)");
+  }
+  const std::string options =
+      "lowerdir=" + lower + ",upperdir=" + upper + ",workdir=" + work;
+  if (mount(
+        "overlay" /* source */,
+        merged.c_str() /* target */,
+        "overlay" /* filesystemtype */,
+        0 /* mountflags */,
+        options.c_str() /* data */) == -1) {
+    errExit("mount(overlay, merged)");
+  }
+  int treefd = open_tree(
+      AT_FDCWD, merged.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+  if (treefd == -1) {
+    errExit("open_tree(merged, OPEN_TREE_CLONE)");
+  }
+  // The overlay keeps its own references to the layers.
+  if (umount2(stagingDir, MNT_DETACH) == -1) {
+    errExit("umount2(stagingDir, MNT_DETACH)");
+  }
+  if (rmdir(stagingDir) == -1) {
+    errExit("rmdir(stagingDir)");
+  }
+  return treefd;
+}
 
-  // (8) Enable NAT
+// Called in a helper process forked by the agent.
+// Turns the mount namespace of the calling process into one that only contains
+// an empty tmpfs as its root.
+void createEmptyMountNs() {
+  if (unshare(CLONE_NEWNS) == -1) {
+    errExit("unshare(CLONE_NEWNS)");
+  }
+  // Make sure detaching the host mounts doesn't propagate back to the host.
+  if (mount("", "/", nullptr, MS_PRIVATE | MS_REC, nullptr) == -1) {
+    errExit("mount(/, MS_PRIVATE | MS_REC)");
+  }
+  int tmpfsfd = mountDetached(
+      "tmpfs",
+      {{"mode", "0755"}, {"size", "1m"}},
+      MOUNT_ATTR_NODEV | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NOEXEC);
+  // The container stages the overlay in /tmp.
+  if (mkdirat(tmpfsfd, "tmp", 01777) == -1) {
+    errExit("mkdirat(tmp)");
+  }
+  if (move_mount(tmpfsfd, "", AT_FDCWD, "/", MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+    errExit("move_mount(tmpfs, /)");
+  }
+  if (fchdir(tmpfsfd) == -1) {
+    errExit("fchdir(tmpfs)");
+  }
+  if (syscall(SYS_pivot_root, ".", ".") == -1) {
+    errExit("pivot_root(\".\", \".\")");
+  }
+  if (umount2(".", MNT_DETACH) == -1) {
+    errExit("umount2(\".\", MNT_DETACH)");
+  }
+  close(tmpfsfd);
+}
+
+// Called in parent (agent) process.
+// Makes a directory a private mount, bound onto itself first if it isn't a
+// mount yet, so that nothing mounted under it propagates to peers.
+void makePrivateMount(const std::string& path) {
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), 0, 0, &stx) == -1) {
+    errExit(("statx(" + path + ")").c_str());
+  }
+  if (!(stx.stx_attributes & STATX_ATTR_MOUNT_ROOT) &&
+      mount(
+          path.c_str() /* source */,
+          path.c_str() /* target */,
+          nullptr /* filesystemtype: IGNORED*/,
+          MS_BIND | MS_REC /* mountflags */,
+          nullptr /* data: IGNORED*/) == -1) {
+    errExit(("mount(" + path + ", MS_BIND)").c_str());
+  }
+  if (mount(nullptr, path.c_str(), nullptr, MS_PRIVATE, nullptr) == -1) {
+    errExit(("mount(" + path + ", MS_PRIVATE)").c_str());
+  }
+}
+
+// Called in parent (agent) process.
+// Returns an fd of the template mount namespace. The first agent creates it
+// and pins it at kMountNsTemplate so that later containers can start from it
+// instead of from a copy of the host's mount table.
+int openMountNsTemplate() {
+  if (mkdir(kStateRoot.c_str(), 0755) == -1 && errno != EEXIST) {
+    errExit("mkdir(kStateRoot)");
+  }
+  const std::string lockPath = kMountNsTemplate + ".lock";
+  int lockfd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lockfd == -1 || flock(lockfd, LOCK_EX) == -1) {
+    errExit("flock(mntns.lock)");
+  }
+
+  // The file is only a namespace once the template has been pinned on it.
+  int nsfd = open(kMountNsTemplate.c_str(), O_RDONLY | O_CLOEXEC);
+  struct statfs fs;
+  if (nsfd != -1 && (fstatfs(nsfd, &fs) == -1 || fs.f_type != NSFS_MAGIC)) {
+    close(nsfd);
+    nsfd = -1;
+  }
+  if (nsfd == -1) {
+    int fd = open(
+        kMountNsTemplate.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+      errExit("open(kMountNsTemplate)");
+    }
+    close(fd);
+
+    int readyfd[2];
+    int donefd[2];
+    if (pipe2(readyfd, O_CLOEXEC) != 0 || pipe2(donefd, O_CLOEXEC) != 0) {
+      errExit("pipe2");
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+      errExit("fork");
+    }
+    if (pid == 0) {
+      // Create the namespace and keep it alive until the agent has pinned it.
+      createEmptyMountNs();
+      char c = 0;
+      close(donefd[1]);
+      if (write(readyfd[1], &c, 1) != 1) {
+        _exit(EXIT_FAILURE);
+      }
+      while (read(donefd[0], &c, 1) == -1 && errno == EINTR) {
+      }
+      _exit(EXIT_SUCCESS);
+    }
+    close(readyfd[1]);
+    close(donefd[0]);
+    char c;
+    if (read(readyfd[0], &c, 1) != 1) {
+      errExit("creating the template mount namespace failed");
+    }
+    // The kernel refuses to pin a mount namespace on a mount with peers,
+    // which it would be under a shared /run, the default of systemd.
+    makePrivateMount(kStateRoot);
+    const std::string nsPath = "/proc/" + std::to_string(pid) + "/ns/mnt";
+    if (mount(
+          nsPath.c_str() /* source */,
+          kMountNsTemplate.c_str() /* target */,
+          nullptr /* filesystemtype: IGNORED*/,
+          MS_BIND /* mountflags */,
+          nullptr /* data: IGNORED*/) == -1) {
+      errExit("mount(mntns, kMountNsTemplate, MS_BIND)");
+    }
+    close(readyfd[0]);
+    close(donefd[1]);
+    waitpid(pid, nullptr, 0);
+
+    nsfd = open(kMountNsTemplate.c_str(), O_RDONLY | O_CLOEXEC);
+    if (nsfd == -1) {
+      errExit("open(kMountNsTemplate)");
+    }
+  }
+  close(lockfd);
+  return nsfd;
+}
+
+// Parses a volume spec HOST_PATH:CONTAINER_PATH[:OPTIONS], where OPTIONS is a
+// comma separated list of ro, rw, noatime, nosuid, nodev and noexec.
+bool parseVolume(const std::string& spec, Volume& volume) {
+  std::vector<std::string> fields;
+  std::istringstream iss(spec);
+  std::string field;
+  while (std::getline(iss, field, ':')) {
+    fields.push_back(field);
+  }
+  if (fields.size() < 2 || fields.size() > 3 || fields[0].empty() ||
+      fields[1].empty() || fields[1][0] != '/') {
+    return false;
+  }
+  volume.hostPath = fields[0];
+  volume.containerPath = fields[1];
+  if (fields.size() == 2) {
+    return true;
+  }
+  std::istringstream options(fields[2]);
+  std::string option;
+  while (std::getline(options, option, ',')) {
+    if (option == "ro") {
+      volume.attr.attr_set |= MOUNT_ATTR_RDONLY;
+    } else if (option == "rw") {
+      volume.attr.attr_set &= ~MOUNT_ATTR_RDONLY;
+    } else if (option == "noatime") {
+      // atime settings are exclusive and need to be cleared first.
+      volume.attr.attr_clr |= MOUNT_ATTR__ATIME;
+      volume.attr.attr_set |= MOUNT_ATTR_NOATIME;
+    } else if (option == "nosuid") {
+      volume.attr.attr_set |= MOUNT_ATTR_NOSUID;
+    } else if (option == "nodev") {
+      volume.attr.attr_set |= MOUNT_ATTR_NODEV;
+    } else if (option == "noexec") {
+      volume.attr.attr_set |= MOUNT_ATTR_NOEXEC;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses a tmpfs spec CONTAINER_PATH[:OPTIONS], where OPTIONS is a comma
+// separated list of size=BYTES, nr_inodes=N, mode=OCTAL and huge=POLICY as
+// well as the ro, noatime and noexec volume options. huge=POLICY selects
+// whether the tmpfs is backed by transparent huge pages, one of never,
+// always, within_size and advise.
+bool parseTmpfs(const std::string& spec, Volume& volume) {
+  size_t colon = spec.find(':');
+  volume.containerPath = spec.substr(0, colon);
+  if (volume.containerPath.empty() || volume.containerPath[0] != '/') {
+    return false;
+  }
+  // Scratch space is writable by everyone by default, like /tmp.
+  volume.tmpfsParams = {{"mode", "1777"}, {"source", "tmpfs"}};
+  volume.attr.attr_set = MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV;
+  if (colon == std::string::npos) {
+    return true;
+  }
+  std::istringstream options(spec.substr(colon + 1));
+  std::string option;
+  while (std::getline(options, option, ',')) {
+    size_t eq = option.find('=');
+    const std::string key = option.substr(0, eq);
+    const std::string value =
+        eq == std::string::npos ? "" : option.substr(eq + 1);
+    if (key == "ro") {
+      volume.attr.attr_set |= MOUNT_ATTR_RDONLY;
+    } else if (key == "noatime") {
+      volume.attr.attr_clr |= MOUNT_ATTR__ATIME;
+      volume.attr.attr_set |= MOUNT_ATTR_NOATIME;
+    } else if (key == "noexec") {
+      volume.attr.attr_set |= MOUNT_ATTR_NOEXEC;
+    } else if (key == "huge") {
+      if (value != "never" && value != "always" && value != "within_size" &&
+          value != "advise") {
+        return false;
+      }
+      volume.tmpfsParams.push_back({key, value});
+    } else if (key == "mode") {
+      volume.tmpfsParams[0].second = value;
+    } else if ((key == "size" || key == "nr_inodes") && !value.empty()) {
+      volume.tmpfsParams.push_back({key, value});
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Called in parent (agent) process.
+// Creates a volume as a detached mount tree and applies the mount options to
+// every mount in the tree at once. A host path is cloned and a tmpfs is
+// created empty. Pages of a tmpfs are charged to the memory cgroup of the
+// container that writes them.
+void prepareVolume(Volume& volume) {
+  if (volume.hostPath.empty()) {
+    volume.treefd = mountDetached("tmpfs", volume.tmpfsParams, 0);
+  } else {
+    volume.treefd = open_tree(
+        AT_FDCWD,
+        volume.hostPath.c_str(),
+        OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+    if (volume.treefd == -1) {
+      errExit("open_tree(volume, OPEN_TREE_CLONE | AT_RECURSIVE)");
+    }
+    // Like the rootfs, don't let mounts in the volume propagate to the host.
+    volume.attr.propagation = MS_SLAVE;
+  }
+  if ((volume.attr.attr_set || volume.attr.attr_clr ||
+       volume.attr.propagation) &&
+      mount_setattr(
+          volume.treefd,
+          "",
+          AT_EMPTY_PATH | AT_RECURSIVE,
+          &volume.attr,
+          sizeof(volume.attr)) == -1) {
+    errExit("mount_setattr(volume, AT_RECURSIVE)");
+  }
+}
+
+// Called in child (container) process.
+// Creates the mount point for a volume in the container if it doesn't exist.
+void makeMountPoint(const std::string& path, bool isDir) {
+  size_t pos = 0;
+  while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+    const std::string dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+      errExit("mkdir(mount point)");
+    }
+  }
+  if (isDir) {
+    if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+      errExit("mkdir(mount point)");
+    }
+  } else {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      errExit("open(mount point)");
+    }
+    close(fd);
+  }
+}
+
+// Called in child (container) process, before pivot_root(), with the rootfs
+// attached. If a mount point doesn't exist in the rootfs, the nearest existing
+// directory on its path gets a tmpfs overlay, so that attachVolume() creates
+// the mount point in memory instead of writing to the rootfs, which is the
+// host's directory or a read-only image. A mount point that is missing right
+// under "/" would need the whole rootfs overlaid, so it must exist.
+// writableDirs are the directories under which mount points are already
+// created elsewhere than in the rootfs: the earlier volumes and the directories
+// that got an overlay, which this adds to.
+void prepareMountPoint(
+    int rootfd,
+    const std::string& path,
+    std::vector<std::string>& writableDirs) {
+  for (const auto& dir : writableDirs) {
+    if (path.compare(0, dir.size() + 1, dir + "/") == 0) {
+      return;
+    }
+  }
+  struct open_how how = {};
+  how.flags = O_PATH | O_CLOEXEC;
+  // Symlinks and ".." are resolved as if the container root was "/".
+  how.resolve = RESOLVE_IN_ROOT;
+  std::string dir = path;
+  int dirfd;
+  for (;;) {
+    dirfd = syscall(
+        SYS_openat2, rootfd, dir.empty() ? "/" : dir.c_str(), &how,
+        sizeof(how));
+    if (dirfd != -1 || errno != ENOENT || dir.empty()) {
+      break;
+    }
+    dir.resize(dir.rfind('/'));
+  }
+  if (dirfd == -1) {
+    errExit(("openat2(" + dir + ")").c_str());
+  }
+  if (dir == path) {
+    close(dirfd);
+    return;
+  }
+  if (dir.empty()) {
+    errno = ENOENT;
+    errExit(("mount point " + path + " (create " +
+             path.substr(0, path.find('/', 1)) +
+             " in the rootfs or use --overlay)").c_str());
+  }
+  int lowerfd = open_tree(
+      dirfd, "", OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_EMPTY_PATH);
+  if (lowerfd == -1) {
+    errExit("open_tree(mount point parent, OPEN_TREE_CLONE)");
+  }
+  int overlayfd = mountOverlay(lowerfd);
+  if (move_mount(
+        overlayfd,
+        "",
+        dirfd,
+        "",
+        MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH) == -1) {
+    errExit("move_mount(overlay, mount point parent)");
+  }
+  close(overlayfd);
+  close(lowerfd);
+  close(dirfd);
+  writableDirs.push_back(dir);
+}
+
+// Called in child (container) process, after pivot_root() so that symlinks in
+// the container path are resolved inside the container.
+void attachVolume(const Volume& volume) {
+  struct stat st;
+  if (fstat(volume.treefd, &st) == -1) {
+    errExit("fstat(volume)");
+  }
+  makeMountPoint(volume.containerPath, S_ISDIR(st.st_mode));
+  if (move_mount(
+        volume.treefd,
+        "",
+        AT_FDCWD,
+        volume.containerPath.c_str(),
+        MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+    errExit("move_mount(volume)");
+  }
+  close(volume.treefd);
+}
+
+// Parses a user namespace spec HOSTID[:COUNT]. COUNT defaults to 65536. The
+// range must end below the invalid id (uid_t)-1.
+bool parseIdMapping(const std::string& spec, IdMapping& mapping) {
+  size_t colon = spec.find(':');
+  unsigned long hostId;
+  unsigned long count = 65536;
+  try {
+    size_t pos;
+    const std::string hostIdSpec = spec.substr(0, colon);
+    hostId = std::stoul(hostIdSpec, &pos);
+    if (pos != hostIdSpec.size() || !isdigit(hostIdSpec[0])) {
+      return false;
+    }
+    if (colon != std::string::npos) {
+      const std::string countSpec = spec.substr(colon + 1);
+      count = std::stoul(countSpec, &pos);
+      if (pos != countSpec.size() || !isdigit(countSpec[0])) {
+        return false;
+      }
+    }
+  } catch (const std::exception&) {
+    return false;
+  }
+  const unsigned long maxId = static_cast<uid_t>(-1);
+  if (count == 0 || hostId >= maxId || count > maxId - hostId) {
+    return false;
+  }
+  mapping.hostId = hostId;
+  mapping.count = count;
+  return true;
+}
+
+// Called in parent (agent) process, after the id maps are written.
+// Makes the rootfs and volume mount trees idmapped mounts of the container's
+// user namespace, so that files owned by uid N on disk are owned by uid N in
+// the container. One tree on disk can then be shared by containers with
+// different host uid ranges, instead of a chowned copy per range.
+void idmapMountTrees(
+    int cpid,
+    int rootTreeFd,
+    const std::vector<Volume>& volumes) {
+  const std::string nsPath = "/proc/" + std::to_string(cpid) + "/ns/user";
+  int usernsfd = open(nsPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (usernsfd == -1) {
+    errExit("open(/proc/<cpid>/ns/user)");
+  }
+  struct mount_attr attr = {};
+  attr.attr_set = MOUNT_ATTR_IDMAP;
+  attr.userns_fd = usernsfd;
+  std::vector<int> treefds{rootTreeFd};
+  for (const auto& volume : volumes) {
+    treefds.push_back(volume.treefd);
+  }
+  for (int treefd : treefds) {
+    if (mount_setattr(
+          treefd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr)) ==
+        -1) {
+      errExit("mount_setattr(MOUNT_ATTR_IDMAP)");
+    }
+  }
+  close(usernsfd);
+}
+
+// Called in child (container) process, after the agent wrote the id maps.
+// The container starts with the host root's ids, which are unmapped in its
+// user namespace. Switch to the ids of root in the namespace, which keeps
+// all capabilities in it.
+void becomeUserNsRoot() {
+  if (setgroups(0, nullptr) == -1) {
+    errExit("setgroups");
+  }
+  if (setresgid(0, 0, 0) == -1) {
+    errExit("setresgid");
+  }
+  if (setresuid(0, 0, 0) == -1) {
+    errExit("setresuid");
+  }
+}
+
+// rootTreeFd is the container root mount tree built by the agent.
+// mountNsTemplateFd is the template mount namespace to start from, or -1 if
+// the container got a copy of the host's mount namespace from clone().
+void setupFilesystem(
+    int rootTreeFd,
+    bool overlay,
+    int mountNsTemplateFd,
+    const std::vector<Volume>& volumes) {
+  if (rootTreeFd == -1) {
+    return;
+  }
+  // (1) Get a mount namespace of our own. clone() already created one as a
+  // copy of the host's, unless the container starts from the template, which
+  // has a single mount no matter how many mounts the host has.
+  if (mountNsTemplateFd != -1) {
+    if (setns(mountNsTemplateFd, CLONE_NEWNS) == -1) {
+      errExit("setns(mountNsTemplateFd, CLONE_NEWNS)");
+    }
+    close(mountNsTemplateFd);
+    if (unshare(CLONE_NEWNS) == -1) {
+      errExit("unshare(CLONE_NEWNS)");
+    }
+  }
+  // (2) Change the propagation type of all mount points to MS_SLAVE.
+  // Equivalent to "mount --make-rslave /"
+  if (mount(
+        "" /* source: IGNORED */,
+        "/" /* target */,
+        nullptr /* filesystemtype: IGNORED*/,
+        MS_SLAVE | MS_REC /* mountflags */,
+        nullptr /* data: IGNORED*/) == -1) {
+    errExit("mount(/, MS_SLAVE | MS_REC)");
+  }
+
+  int rootfd = rootTreeFd;
+  if (overlay) {
+    rootfd = mountOverlay(rootTreeFd);
+  }
+  // (3) Attach the rootfs mount tree on top of "/", and make sure that the
+  // mount points of the volumes can be created without writing to it. A
+  // volume inside an earlier volume gets its mount point there instead.
+  if (move_mount(rootfd, "", AT_FDCWD, "/", MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+    errExit("move_mount(rootfs, /)");
+  }
+  if (!overlay) {
+    std::vector<std::string> writableDirs;
+    for (const auto& volume : volumes) {
+      prepareMountPoint(rootfd, volume.containerPath, writableDirs);
+      writableDirs.push_back(volume.containerPath);
+    }
+  }
+  // (4) Enter rootfs
+  if (fchdir(rootfd) == -1) {
+    errExit("fchdir(rootfs)");
+  }
+  close(rootfd);
+  // (5) Mount procfs for the container. In a user namespace, procfs can only
+  // be mounted while a fully visible one exists in the mount namespace, so
+  // this happens before the host's /proc is detached.
+  if (mount(
+        "proc" /* source */,
+        "proc" /* target: relative to rootfs */,
+        "proc" /* filesystemtype */,
+        MS_NOSUID | MS_NOEXEC | MS_NODEV /* mountflags */,
+        nullptr /* data: IGNORED*/) == -1) {
+    errExit("mount(proc, /proc, MS_NOSUID | MS_NOEXEC | MS_NODEV)");
+  }
+  // (6) Make rootfs the root mount. The old root is stacked on top of it.
+  if (syscall(SYS_pivot_root, ".", ".") == -1) {
+    errExit("pivot_root(\".\", \".\")");
+  }
+  // (7) Detach the old root together with all the host mounts under it.
+  if (umount2(".", MNT_DETACH) == -1) {
+    errExit("umount2(\".\", MNT_DETACH)");
+  }
+  // (8) Change current directory to "/"
+  if (chdir("/") == -1) {
+    errExit("chdir(\"/\")");
+  }
+  // (9) Attach the volumes
+  for (const auto& volume : volumes) {
+    attachVolume(volume);
+  }
+  // (10) Let any changes in the container propagae to its children if any
+  if (mount(
+        "" /* source: IGNORED */,
+        "/" /* target */,
+        nullptr /* filesystemtype: IGNORED*/,
+        MS_SHARED | MS_REC /* mountflags */,
+        nullptr /* data: IGNORED*/) == -1) {
+    errExit("mount(/, MS_SHARED | MS_REC)");
+  }
+}
+
+// A range of a rootfs file to be read into the page cache before the container
+// starts. Prefetch lists are stored next to the rootfs as "<rootfs>.prefetch",
+// one "<offset> <length> <path>" line per range, with paths relative to the
+// container root.
+struct PrefetchRange {
+  off_t offset;
+  off_t length;
+  std::string path;
+};
+
+std::string getPrefetchListPath(std::string rootfs) {
+  while (rootfs.size() > 1 && rootfs.back() == '/') {
+    rootfs.pop_back();
+  }
+  return rootfs + ".prefetch";
+}
+
+std::vector<PrefetchRange>* recordedRanges = nullptr;
+size_t recordRootLength = 0;
+
+// nftw() callback that records the resident pages of a file.
+int recordResidentPages(
+    const char* path,
+    const struct stat* st,
+    int typeflag,
+    struct FTW* /* ftwbuf */) {
+  if (typeflag != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) {
+    return 0;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+  if (fd == -1) {
+    return 0;
+  }
+  // mincore() reports which pages of a file mapping are in the page cache
+  // without faulting them in.
+  void* addr = mmap(nullptr, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return 0;
+  }
+  const long pageSize = sysconf(_SC_PAGESIZE);
+  const size_t pages = (st->st_size + pageSize - 1) / pageSize;
+  std::vector<unsigned char> residency(pages);
+  if (mincore(addr, st->st_size, residency.data()) == 0) {
+    // Coalesce resident pages into ranges.
+    const std::string relPath = path + recordRootLength;
+    size_t i = 0;
+    while (i < pages) {
+      if (!(residency[i] & 1)) {
+        ++i;
+        continue;
+      }
+      size_t j = i;
+      while (j < pages && (residency[j] & 1)) {
+        ++j;
+      }
+      recordedRanges->push_back(
+          {static_cast<off_t>(i * pageSize),
+           static_cast<off_t>((j - i) * pageSize),
+           relPath});
+      i = j;
+    }
+  }
+  munmap(addr, st->st_size);
+  return 0;
+}
+
+// Called in parent (agent) process.
+// Records the parts of the rootfs files that are in the page cache. Recording
+// right after a cold start captures what the container reads while starting.
+void recordPrefetchList(const std::string& root, const std::string& listPath) {
+  std::vector<PrefetchRange> ranges;
+  recordedRanges = &ranges;
+  // Strip "<root>/" from the recorded paths.
+  recordRootLength = root.back() == '/' ? root.size() : root.size() + 1;
+  // Only walk the rootfs filesystem itself and don't follow symlinks.
+  if (nftw(root.c_str(), recordResidentPages, 64, FTW_PHYS | FTW_MOUNT) ==
+      -1) {
+    errExit("nftw(rootfs)");
+  }
+  recordedRanges = nullptr;
+
+  std::ofstream ofs(listPath);
+  if (!ofs.is_open()) {
+    std::cout << "Error: Failed to open " << listPath << std::endl;
+    return;
+  }
+  off_t total = 0;
+  for (const auto& range : ranges) {
+    ofs << range.offset << " " << range.length << " " << range.path << "\n";
+    total += range.length;
+  }
+  std::cout << "[Agent] Recorded " << ranges.size() << " ranges (" << total
+            << " bytes) to " << listPath << std::endl;
+}
+
+std::vector<PrefetchRange> readPrefetchList(const std::string& listPath) {
+  std::vector<PrefetchRange> ranges;
+  std::ifstream ifs(listPath);
+  PrefetchRange range;
+  while (ifs >> range.offset >> range.length &&
+         std::getline(ifs >> std::ws, range.path)) {
+    ranges.push_back(range);
+  }
+  return ranges;
+}
+
+// Called in parent (agent) process.
+// Starts reading the ranges in the prefetch list into the page cache in
+// parallel. The returned threads must be joined before the container is
+// released.
+std::vector<std::thread> startPrefetch(
+    const std::string& root,
+    const std::vector<PrefetchRange>& ranges) {
+  // Hand out the ranges to the workers one file at a time so that each file
+  // is opened once.
+  auto next = std::make_shared<std::atomic<size_t>>(0);
+  auto worker = [root, &ranges, next]() {
+    for (;;) {
+      size_t begin = next->fetch_add(1);
+      if (begin >= ranges.size()) {
+        return;
+      }
+      if (begin > 0 && ranges[begin - 1].path == ranges[begin].path) {
+        // Owned by the worker that got the first range of the file.
+        continue;
+      }
+      const std::string path = root + "/" + ranges[begin].path;
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      if (fd == -1) {
+        continue;
+      }
+      for (size_t i = begin;
+           i < ranges.size() && ranges[i].path == ranges[begin].path;
+           ++i) {
+        readahead(fd, ranges[i].offset, ranges[i].length);
+      }
+      close(fd);
+    }
+  };
+
+  const unsigned workers =
+      std::max(1u, std::min(std::thread::hardware_concurrency(), 8u));
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < workers; ++i) {
+    threads.emplace_back(worker);
+  }
+  return threads;
+}
+
+// Called in parent (agent) process.
+// Waits until the container exits or the timeout expires, whichever is first.
+void waitForContainerOrTimeout(int cpid, int timeoutMs) {
+  int pidfd = syscall(SYS_pidfd_open, cpid, 0);
+  if (pidfd == -1) {
+    errExit("pidfd_open");
+  }
+  struct pollfd pfd = {pidfd, POLLIN, 0};
+  int ret = 0;
+  do {
+    ret = poll(&pfd, 1, timeoutMs);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1) {
+    errExit("poll(pidfd)");
+  }
+  close(pidfd);
+}
+
+void setHostAndDomainName(
+    const std::string& hostname,
+    const std::string& nisDomainName) {
+  if (!hostname.empty() &&
+      sethostname(hostname.c_str(), hostname.length()) != 0) {
+    errExit("sethostname");
+  }
+  if (!nisDomainName.empty() &&
+      setdomainname(nisDomainName.c_str(), nisDomainName.length()) != 0) {
+    errExit("setdomainname");
+  }
+}
+
+// A netlink request being built: a sequence of messages with attributes,
+// sent in one sendmsg().
+struct NetlinkRequest {
+  std::vector<char> buf;
+  uint32_t seq;
+  // The last message that gets a reply: an acknowledgment or the end of a
+  // dump.
+  uint32_t lastReplySeq;
+  NetlinkRequest() : seq(0), lastReplySeq(0) {}
+};
+
+void alignNetlinkRequest(NetlinkRequest& request) {
+  request.buf.resize(NLMSG_ALIGN(request.buf.size()));
+}
+
+// Starts a message whose family specific header, e.g. struct ifinfomsg, is
+// `header`. Returns its offset for endNetlinkMessage().
+size_t beginNetlinkMessage(
+    NetlinkRequest& request,
+    uint16_t type,
+    uint16_t flags,
+    const void* header,
+    size_t headerLen) {
+  alignNetlinkRequest(request);
+  const size_t start = request.buf.size();
+  request.buf.resize(start + NLMSG_SPACE(headerLen));
+  struct nlmsghdr* nlh =
+      reinterpret_cast<struct nlmsghdr*>(&request.buf[start]);
+  nlh->nlmsg_type = type;
+  nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+  nlh->nlmsg_seq = ++request.seq;
+  if (flags & (NLM_F_ACK | NLM_F_DUMP)) {
+    request.lastReplySeq = request.seq;
+  }
+  memcpy(NLMSG_DATA(nlh), header, headerLen);
+  return start;
+}
+
+void endNetlinkMessage(NetlinkRequest& request, size_t start) {
+  reinterpret_cast<struct nlmsghdr*>(&request.buf[start])->nlmsg_len =
+      request.buf.size() - start;
+}
+
+void addNetlinkAttr(
+    NetlinkRequest& request,
+    uint16_t type,
+    const void* data,
+    size_t len) {
+  alignNetlinkRequest(request);
+  const size_t start = request.buf.size();
+  request.buf.resize(start + NLA_HDRLEN + len);
+  struct nlattr* attr = reinterpret_cast<struct nlattr*>(&request.buf[start]);
+  attr->nla_type = type;
+  attr->nla_len = NLA_HDRLEN + len;
+  memcpy(&request.buf[start + NLA_HDRLEN], data, len);
+}
+
+void addNetlinkAttr(
+    NetlinkRequest& request,
+    uint16_t type,
+    const std::string& value) {
+  addNetlinkAttr(request, type, value.c_str(), value.size() + 1);
+}
+
+template <typename T>
+void addNetlinkAttr(NetlinkRequest& request, uint16_t type, const T& value) {
+  addNetlinkAttr(request, type, &value, sizeof(value));
+}
+
+// Starts a nested attribute. Returns its offset for endNetlinkNest().
+size_t beginNetlinkNest(NetlinkRequest& request, uint16_t type) {
+  alignNetlinkRequest(request);
+  const size_t start = request.buf.size();
+  addNetlinkAttr(request, type | NLA_F_NESTED, nullptr, 0);
+  return start;
+}
+
+void endNetlinkNest(NetlinkRequest& request, size_t start) {
+  reinterpret_cast<struct nlattr*>(&request.buf[start])->nla_len =
+      request.buf.size() - start;
+}
+
+// Sends a request on a new netlink socket of the given protocol and reads
+// the replies until every message is acknowledged, calling onMessage for
+// the messages of a dump. Returns 0, or the first error as a negative errno.
+int sendNetlinkRequest(
+    int protocol,
+    NetlinkRequest& request,
+    const std::function<void(const struct nlmsghdr*)>& onMessage = nullptr) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+  if (fd == -1) {
+    return -errno;
+  }
+  struct sockaddr_nl addr = {};
+  addr.nl_family = AF_NETLINK;
+  if (sendto(fd, request.buf.data(), request.buf.size(), 0,
+             reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+    close(fd);
+    return -errno;
+  }
+  // An error ends the request, since the kernel stops at the first failed
+  // message, or rolls back a whole nftables batch.
+  int error = 0;
+  bool done = false;
+  std::vector<char> buf(32 * 1024);
+  while (!done) {
+    ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = -errno;
+      break;
+    }
+    for (struct nlmsghdr* nlh = reinterpret_cast<struct nlmsghdr*>(buf.data());
+         NLMSG_OK(nlh, n);
+         nlh = NLMSG_NEXT(nlh, n)) {
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        const int err =
+            static_cast<struct nlmsgerr*>(NLMSG_DATA(nlh))->error;
+        if (error == 0) {
+          error = err;
+        }
+        done = done || nlh->nlmsg_seq == request.lastReplySeq || err != 0;
+      } else if (nlh->nlmsg_type == NLMSG_DONE) {
+        done = done || nlh->nlmsg_seq == request.lastReplySeq;
+      } else if (onMessage) {
+        onMessage(nlh);
+      }
+    }
+  }
+  close(fd);
+  return error;
+}
+
+// Calls onAttr for each attribute in [attrs, attrs + len).
+void forEachNetlinkAttr(
+    const void* attrs,
+    size_t len,
+    const std::function<void(const struct nlattr*)>& onAttr) {
+  const char* p = static_cast<const char*>(attrs);
+  while (len >= NLA_HDRLEN) {
+    const struct nlattr* attr = reinterpret_cast<const struct nlattr*>(p);
+    if (attr->nla_len < NLA_HDRLEN || attr->nla_len > len) {
+      return;
+    }
+    onAttr(attr);
+    const size_t size = std::min<size_t>(NLA_ALIGN(attr->nla_len), len);
+    p += size;
+    len -= size;
+  }
+}
+
+const void* getNetlinkAttrData(const struct nlattr* attr) {
+  return reinterpret_cast<const char*>(attr) + NLA_HDRLEN;
+}
+
+size_t getNetlinkAttrLength(const struct nlattr* attr) {
+  return attr->nla_len - NLA_HDRLEN;
+}
+
+// Returns the first attribute of the given type in [attrs, attrs + len), or
+// nullptr.
+const struct nlattr* findNetlinkAttr(
+    const void* attrs,
+    size_t len,
+    uint16_t type) {
+  const struct nlattr* found = nullptr;
+  forEachNetlinkAttr(attrs, len, [&found, type](const struct nlattr* attr) {
+    if (found == nullptr && (attr->nla_type & NLA_TYPE_MASK) == type) {
+      found = attr;
+    }
+  });
+  return found;
+}
+
+// The network of a container. In bridge mode it gets a veth pair to the
+// default bridge. In routed mode it gets a veth pair that is not on any
+// bridge, and the host routes to it on a /32 route. The macvlan and ipvlan
+// modes make its eth0 a sub-interface of a host interface, so its packets
+// skip the bridge and the netfilter hooks of the host. These take --ip. In
+// none and loopback modes it gets a network namespace of only lo, which costs
+// no work on the host, and in host mode it shares the network of the host.
+// Unlike docker's none, none leaves lo down, so that nothing can be reached,
+// not even within the container; loopback brings it up.
+struct NetworkOptions {
+  // One of kNetModes.
+  std::string mode;
+  // The host interface of the sub-interface.
+  std::string parent;
+  // Prefix length of the address of the container.
+  std::string prefixLen;
+  // Default gateway of the container, if any.
+  std::string gateway;
+  NetworkOptions() : mode("bridge") {}
+};
+
+// Whether the container is connected by a veth pair, whose host end is
+// "veth<pid>".
+bool hasVethPair(const NetworkOptions& network) {
+  return network.mode == "bridge" || network.mode == "routed";
+}
+
+// Called in parent (agent) process.
+void prepareNetwork(
+    int containerPid,
+    const std::string& ip,
+    const NetworkOptions& network) {
+  const bool routed = network.mode == "routed";
+  std::string cmd;
+  if (!routed) {
+    // (1) Create the default bridge if it doesn't exist.
+    cmd = "ip link add name " + kDefaultBridgeName + " type bridge";
+    system(cmd.c_str());
+
+    // (2) Make sure the bridge is up.
+    cmd = "ip link set " + kDefaultBridgeName + " up";
+    if (system(cmd.c_str()) != 0) {
+      errExit("setting default bridge up failed");
+    }
+
+    // (3) Add IP to the bridge if it doesn't exist.
+    cmd = "ip addr add " + kDefaultBridgeIp + "/" + kDefaultBridgePrefixLen +
+          " brd + dev " + kDefaultBridgeName;
+    system(cmd.c_str());
+  }
+
+  // Answer ARP on the bridge for the routed containers, which are in
+  // the subnet of the bridge but not on it. The host has a /32 route to each
+  // of them that doesn't go through the bridge, and only for those does
+  // proxy ARP answer. Routed mode only sets it if the bridge exists, since
+  // bridge mode sets it when it creates the bridge.
+  cmd = "sysctl -q -w net.ipv4.conf." + kDefaultBridgeName + ".proxy_arp=1";
+  if ((!routed || if_nametoindex(kDefaultBridgeName.c_str()) != 0) &&
+      system(cmd.c_str()) != 0) {
+    errExit("enabling proxy ARP on the bridge failed");
+  }
+
+  // (4) Create a veth pair between host and container
+  // The veth interface name on the host is int the format "veth<container_pid>"
+  const std::string vethName = "veth" + std::to_string(containerPid);
+  cmd = "ip link add " + vethName + " type veth peer name eth0 netns " +
+        std::to_string(containerPid);
+  if (system(cmd.c_str()) != 0) {
+    errExit("adding veth pair failed");
+  }
+
+  // (5) Bring up the veth interface
+  cmd = "ip link set " + vethName + " up";
+  if (system(cmd.c_str()) != 0) {
+    errExit("setting veth up failed");
+  }
+
+  if (routed) {
+    // (6) Route the address of the container to the veth interface, and
+    // answer ARP for its gateway there. There is no bridge to learn and
+    // flood, and no broadcast domain that grows with the containers. The
+    // route replaces any left by a previous container with the address: the
+    // kernel tears a network namespace down asynchronously after its last
+    // process exits, so the old veth and its route may still be there.
+    cmd = "ip route replace " + ip + "/32 dev " + vethName;
+    if (system(cmd.c_str()) != 0) {
+      errExit("adding route to container failed");
+    }
+    cmd = "sysctl -q -w net.ipv4.conf." + vethName + ".proxy_arp=1";
+    if (system(cmd.c_str()) != 0) {
+      errExit("enabling proxy ARP failed");
+    }
+  } else {
+    // (6) Add the veth interface as a port of the bridge
+    cmd = "ip link set " + vethName + " master " + kDefaultBridgeName;
+    if (system(cmd.c_str()) != 0) {
+      errExit("adding veth to bridge failed");
+    }
+  }
+
+  // (7) Enable IP forwarding
+  cmd = "sysctl -w net.ipv4.ip_forward=1";
+  if (system(cmd.c_str()) != 0) {
+    errExit("enabling net.ipv4.ip_forward failed");
+  }
+
+  // (8) Enable NAT
   cmd = "iptables -t nat -A POSTROUTING -s " + kDefaultBridgeIp + "/" +
         kDefaultBridgePrefixLen + " -j MASQUERADE";
   if (system(cmd.c_str()) != 0) {
-    errExit("enabling NAT failed");
+    errExit("enabling NAT failed");
+  }
+}
+
+// Called in parent (agent) process.
+// Creates the eth0 of the container as a macvlan or ipvlan sub-interface of
+// the parent interface, right in its network namespace.
+void prepareSubInterface(int containerPid, const NetworkOptions& network) {
+  const uint32_t parentIndex = if_nametoindex(network.parent.c_str());
+  if (parentIndex == 0) {
+    errExit(("if_nametoindex(" + network.parent + ")").c_str());
+  }
+  const bool macvlan = network.mode == "macvlan";
+  struct ifinfomsg header = {};
+  header.ifi_family = AF_UNSPEC;
+
+  NetlinkRequest request;
+  size_t msg = beginNetlinkMessage(
+      request,
+      RTM_NEWLINK,
+      NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK,
+      &header,
+      sizeof(header));
+  addNetlinkAttr(request, IFLA_IFNAME, std::string("eth0"));
+  addNetlinkAttr(request, IFLA_LINK, parentIndex);
+  addNetlinkAttr(request, IFLA_NET_NS_PID, static_cast<uint32_t>(containerPid));
+  size_t linkInfo = beginNetlinkNest(request, IFLA_LINKINFO);
+  addNetlinkAttr(
+      request, IFLA_INFO_KIND, std::string(macvlan ? "macvlan" : "ipvlan"));
+  size_t data = beginNetlinkNest(request, IFLA_INFO_DATA);
+  if (macvlan) {
+    // Containers on the same parent talk to each other without leaving the
+    // host, but never to the host through the parent itself.
+    addNetlinkAttr(
+        request, IFLA_MACVLAN_MODE, static_cast<uint32_t>(MACVLAN_MODE_BRIDGE));
+  } else {
+    // In L2 mode the container shares the MAC of the parent and answers ARP
+    // itself. In L3 mode the parent routes for it, and there is no ARP or
+    // broadcast on eth0.
+    addNetlinkAttr(
+        request,
+        IFLA_IPVLAN_MODE,
+        static_cast<uint16_t>(
+            network.mode == "ipvlan-l3" ? IPVLAN_MODE_L3 : IPVLAN_MODE_L2));
+  }
+  endNetlinkNest(request, data);
+  endNetlinkNest(request, linkInfo);
+  endNetlinkMessage(request, msg);
+  int err = sendNetlinkRequest(NETLINK_ROUTE, request);
+  if (err != 0) {
+    errno = -err;
+    errExit(("adding " + network.mode + " interface failed").c_str());
+  }
+}
+
+// Called in parent (agent) process.
+// Returns the prefix length of the IPv4 address of an interface, or an empty
+// string if it has none.
+std::string getInterfacePrefixLen(const std::string& ifname) {
+  struct ifaddrs* addrs;
+  if (getifaddrs(&addrs) == -1) {
+    errExit("getifaddrs");
+  }
+  std::string prefixLen;
+  for (struct ifaddrs* addr = addrs; addr != nullptr; addr = addr->ifa_next) {
+    if (addr->ifa_addr == nullptr || addr->ifa_addr->sa_family != AF_INET ||
+        addr->ifa_netmask == nullptr || ifname != addr->ifa_name) {
+      continue;
+    }
+    const uint32_t netmask =
+        reinterpret_cast<struct sockaddr_in*>(addr->ifa_netmask)
+            ->sin_addr.s_addr;
+    prefixLen = std::to_string(__builtin_popcount(netmask));
+    break;
+  }
+  freeifaddrs(addrs);
+  return prefixLen;
+}
+
+// Called in child (container) process
+void setupNetwork(const std::string& ip, const NetworkOptions& network) {
+  // (1) Bring up lo interface
+  std::string cmd = "ip link set dev lo up";
+  if (system(cmd.c_str()) != 0) {
+    errExit("bring up lo device failed");
+  }
+
+  // (2) Add IP to eth0
+  cmd = "ip addr add " + ip + "/" + network.prefixLen + " dev eth0";
+  if (system(cmd.c_str()) != 0) {
+    errExit("adding IP to eth0 failed");
+  }
+
+  // (3) Bring up eth0 interface
+  cmd = "ip link set dev eth0 up";
+  if (system(cmd.c_str()) != 0) {
+    errExit("bring up eth0 failed");
+  }
+
+  // (4) Set default gateway. In routed mode it is on no subnet of eth0. In
+  // ipvlan L3 mode the parent routes everything that leaves eth0.
+  if (network.mode == "routed") {
+    cmd = "ip route add default via " + network.gateway + " dev eth0 onlink";
+  } else if (!network.gateway.empty()) {
+    cmd = "ip route add default via " + network.gateway;
+  } else if (network.mode == "ipvlan-l3") {
+    cmd = "ip route add default dev eth0";
+  } else {
+    return;
+  }
+  if (system(cmd.c_str()) != 0) {
+    errExit("setting default gateway failed");
+  }
+}
+
+// Called in child (container) process
+// Brings up lo of a network namespace without any other interface, with an
+// ioctl instead of running "ip", so that it costs no process.
+void setupLoopback() {
+  int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sockfd == -1) {
+    errExit("socket(AF_INET)");
+  }
+  struct ifreq ifr = {};
+  strncpy(ifr.ifr_name, "lo", IFNAMSIZ - 1);
+  if (ioctl(sockfd, SIOCGIFFLAGS, &ifr) == -1) {
+    errExit("ioctl(lo, SIOCGIFFLAGS)");
+  }
+  ifr.ifr_flags |= IFF_UP;
+  if (ioctl(sockfd, SIOCSIFFLAGS, &ifr) == -1) {
+    errExit("ioctl(lo, SIOCSIFFLAGS)");
+  }
+  close(sockfd);
+}
+
+// The allocator of the addresses of the default bridge network, shared by
+// all agents through a file mapped from kIpamPath. A bit per address tells
+// whether it is taken, and the agent that took it is recorded, so that the
+// addresses of agents that died can be collected.
+struct IpamHeader {
+  uint64_t magic;
+  // The first address of the subnet, in host byte order, and its size.
+  uint32_t subnet;
+  uint32_t size;
+  // The word of the bitmap where the next search starts, so that searches
+  // don't rescan the taken addresses at the start.
+  std::atomic<uint32_t> cursor;
+};
+
+struct Ipam {
+  IpamHeader* header;
+  // A bit per address, set while it is taken.
+  std::atomic<uint64_t>* bitmap;
+  // The agent that took each address, see getIpOwner(). 0 while it is being
+  // taken.
+  std::atomic<uint64_t>* owners;
+  Ipam() : header(nullptr), bitmap(nullptr), owners(nullptr) {}
+};
+
+size_t getIpamMapSize(uint32_t size) {
+  return kIpamBitmapOffset + size / 8 + size * sizeof(uint64_t);
+}
+
+void mapIpam(int fd, uint32_t size, Ipam& ipam) {
+  void* addr = mmap(
+      nullptr,
+      getIpamMapSize(size),
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      0);
+  if (addr == MAP_FAILED) {
+    errExit("mmap(ipam)");
+  }
+  char* base = static_cast<char*>(addr);
+  ipam.header = static_cast<IpamHeader*>(addr);
+  ipam.bitmap =
+      reinterpret_cast<std::atomic<uint64_t>*>(base + kIpamBitmapOffset);
+  ipam.owners = reinterpret_cast<std::atomic<uint64_t>*>(
+      base + kIpamBitmapOffset + size / 8);
+}
+
+bool parseIp(const std::string& ip, uint32_t& addr) {
+  struct in_addr in;
+  if (inet_pton(AF_INET, ip.c_str(), &in) != 1) {
+    return false;
+  }
+  addr = ntohl(in.s_addr);
+  return true;
+}
+
+std::string formatIp(uint32_t addr) {
+  struct in_addr in;
+  in.s_addr = htonl(addr);
+  char buf[INET_ADDRSTRLEN];
+  return inet_ntop(AF_INET, &in, buf, sizeof(buf));
+}
+
+// Opens the allocator of the default bridge network, creating it on first
+// use. A new allocator is set up in a file of its own and linked into place,
+// so that concurrent agents never see a partial one.
+void openIpam(Ipam& ipam) {
+  uint32_t bridgeIp;
+  parseIp(kDefaultBridgeIp, bridgeIp);
+  const uint32_t size = 1u << (32 - std::stoi(kDefaultBridgePrefixLen));
+  const uint32_t subnet = bridgeIp & ~(size - 1);
+  if (mkdir(kStateRoot.c_str(), 0755) == -1 && errno != EEXIST) {
+    errExit("mkdir(kStateRoot)");
+  }
+  int fd = open(kIpamPath.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT) {
+    const std::string tmpPath =
+        kIpamPath + "." + std::to_string(getpid());
+    fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, getIpamMapSize(size)) == -1) {
+      errExit("open(ipam)");
+    }
+    mapIpam(fd, size, ipam);
+    new (ipam.header) IpamHeader();
+    ipam.header->subnet = subnet;
+    ipam.header->size = size;
+    // The network and broadcast addresses, and the bridge.
+    for (uint32_t index : {0u, bridgeIp - subnet, size - 1}) {
+      ipam.bitmap[index / 64] |= 1ull << (index % 64);
+    }
+    ipam.header->magic = kIpamMagic;
+    munmap(ipam.header, getIpamMapSize(size));
+    close(fd);
+    if (link(tmpPath.c_str(), kIpamPath.c_str()) == -1 && errno != EEXIST) {
+      errExit("link(ipam)");
+    }
+    unlink(tmpPath.c_str());
+    fd = open(kIpamPath.c_str(), O_RDWR | O_CLOEXEC);
+  }
+  if (fd == -1) {
+    errExit("open(ipam)");
+  }
+  mapIpam(fd, size, ipam);
+  close(fd);
+  if (ipam.header->magic != kIpamMagic) {
+    std::cerr << "Error: " << kIpamPath << " is of another version, remove "
+              << "it once no container with --ip runs" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (ipam.header->subnet != subnet || ipam.header->size != size) {
+    std::cerr << "Error: " << kIpamPath << " is not for "
+              << formatIp(subnet) << "/" << kDefaultBridgePrefixLen
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Returns the owner of the addresses taken by the agent pid: the pid, and
+// its start time in the upper half, so that a dead agent whose pid was
+// reused isn't taken for alive. Returns 0 if there is no such process.
+uint64_t getIpOwner(pid_t pid) {
+  std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+  std::string line;
+  const size_t commEnd =
+      std::getline(stat, line) ? line.rfind(')') : std::string::npos;
+  if (commEnd == std::string::npos) {
+    return 0;
+  }
+  // The command may contain spaces, so the fields are counted from after
+  // it. The start time is the 20th.
+  std::istringstream fields(line.substr(commEnd + 1));
+  std::string field;
+  for (int i = 0; i < 20 && fields >> field; ++i) {
+  }
+  uint64_t startTime;
+  if (!fields || !(std::istringstream(field) >> startTime)) {
+    return 0;
+  }
+  return static_cast<uint32_t>(pid) | startTime << 32;
+}
+
+// Takes the address at index for the agent owner. Returns false if it is
+// taken.
+bool claimIp(Ipam& ipam, uint32_t index, uint64_t owner) {
+  const uint64_t bit = 1ull << (index % 64);
+  if (ipam.bitmap[index / 64].fetch_or(bit, std::memory_order_acq_rel) &
+      bit) {
+    return false;
+  }
+  ipam.owners[index].store(owner, std::memory_order_release);
+  return true;
+}
+
+// Gives back an address if it is still held by owner.
+void releaseIp(Ipam& ipam, uint32_t index, uint64_t owner) {
+  uint64_t expected = owner;
+  if (ipam.owners[index].compare_exchange_strong(
+          expected, 0, std::memory_order_acq_rel)) {
+    ipam.bitmap[index / 64].fetch_and(
+        ~(1ull << (index % 64)), std::memory_order_release);
+  }
+}
+
+// Releases the addresses of agents that died without releasing them. Returns
+// how many were released.
+size_t collectIps(Ipam& ipam) {
+  size_t released = 0;
+  for (uint32_t index = 0; index < ipam.header->size; ++index) {
+    const uint64_t owner =
+        ipam.owners[index].load(std::memory_order_acquire);
+    if (owner != 0 && getIpOwner(static_cast<uint32_t>(owner)) != owner) {
+      releaseIp(ipam, index, owner);
+      ++released;
+    }
+  }
+  return released;
+}
+
+// Takes a free address for the agent owner, searching the bitmap a word at a
+// time from where the last search ended. Returns its index, or -1 if the
+// subnet is full.
+int64_t allocateIp(Ipam& ipam, uint64_t owner) {
+  const uint32_t words = ipam.header->size / 64;
+  const uint32_t start = ipam.header->cursor.load(std::memory_order_relaxed);
+  for (uint32_t i = 0; i < words; ++i) {
+    const uint32_t w = (start + i) % words;
+    uint64_t word = ipam.bitmap[w].load(std::memory_order_relaxed);
+    while (word != ~0ull) {
+      const int bit = __builtin_ctzll(~word);
+      if (ipam.bitmap[w].compare_exchange_weak(
+              word, word | (1ull << bit), std::memory_order_acq_rel)) {
+        ipam.owners[w * 64 + bit].store(owner, std::memory_order_release);
+        ipam.header->cursor.store(w, std::memory_order_relaxed);
+        return w * 64 + bit;
+      }
+    }
+  }
+  return -1;
+}
+
+// Called in parent (agent) process.
+// Takes the address for --ip: "auto" allocates a free one and replaces ip
+// with it, other addresses must be in the bridge network and free. Returns
+// the index of the address, or -1 with an error printed.
+int64_t reserveIp(Ipam& ipam, std::string& ip) {
+  const uint64_t owner = getIpOwner(getpid());
+  if (ip == "auto") {
+    int64_t index = allocateIp(ipam, owner);
+    if (index == -1 && collectIps(ipam) > 0) {
+      index = allocateIp(ipam, owner);
+    }
+    if (index == -1) {
+      std::cerr << "Error: No free IP address in "
+                << formatIp(ipam.header->subnet) << "/"
+                << kDefaultBridgePrefixLen << std::endl;
+      return -1;
+    }
+    ip = formatIp(ipam.header->subnet + index);
+    return index;
+  }
+  uint32_t addr;
+  if (!parseIp(ip, addr) ||
+      addr - ipam.header->subnet >= ipam.header->size) {
+    std::cerr << "Error: IP address " << ip << " is not in "
+              << formatIp(ipam.header->subnet) << "/"
+              << kDefaultBridgePrefixLen << std::endl;
+    return -1;
+  }
+  const uint32_t index = addr - ipam.header->subnet;
+  if (!claimIp(ipam, index, owner) &&
+      !(collectIps(ipam) > 0 && claimIp(ipam, index, owner))) {
+    std::cerr << "Error: IP address " << ip << " is in use" << std::endl;
+    return -1;
+  }
+  return index;
+}
+
+// A port of the host published with --publish, e.g. "8080:80/tcp".
+struct PortMapping {
+  uint16_t hostPort;
+  uint16_t containerPort;
+  uint8_t protocol;
+  PortMapping() : hostPort(0), containerPort(0), protocol(IPPROTO_TCP) {}
+};
+
+bool parsePortMapping(const std::string& spec, PortMapping& mapping) {
+  std::string ports = spec;
+  const size_t slash = spec.find('/');
+  if (slash != std::string::npos) {
+    const std::string protocol = spec.substr(slash + 1);
+    if (protocol == "udp") {
+      mapping.protocol = IPPROTO_UDP;
+    } else if (protocol != "tcp") {
+      return false;
+    }
+    ports = spec.substr(0, slash);
+  }
+  const size_t colon = ports.find(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  int hostPort, containerPort;
+  try {
+    size_t end;
+    hostPort = std::stoi(ports.substr(0, colon), &end);
+    if (end != colon) {
+      return false;
+    }
+    containerPort = std::stoi(ports.substr(colon + 1), &end);
+    if (end != ports.size() - colon - 1) {
+      return false;
+    }
+  } catch (const std::exception&) {
+    return false;
+  }
+  if (hostPort <= 0 || hostPort > 65535 || containerPort <= 0 ||
+      containerPort > 65535) {
+    return false;
+  }
+  mapping.hostPort = hostPort;
+  mapping.containerPort = containerPort;
+  return true;
+}
+
+// Starts an nftables message in a batch.
+size_t beginNftMessage(
+    NetlinkRequest& request,
+    uint16_t type,
+    uint16_t flags,
+    uint16_t resId = 0) {
+  struct nfgenmsg header = {};
+  header.nfgen_family = NFPROTO_IPV4;
+  header.version = NFNETLINK_V0;
+  header.res_id = htons(resId);
+  return beginNetlinkMessage(
+      request,
+      type < NFNL_MSG_BATCH_BEGIN ? (NFNL_SUBSYS_NFTABLES << 8) | type : type,
+      flags,
+      &header,
+      sizeof(header));
+}
+
+void addNftBatchBegin(NetlinkRequest& request) {
+  endNetlinkMessage(
+      request,
+      beginNftMessage(request, NFNL_MSG_BATCH_BEGIN, 0, NFNL_SUBSYS_NFTABLES));
+}
+
+void addNftBatchEnd(NetlinkRequest& request) {
+  endNetlinkMessage(
+      request,
+      beginNftMessage(request, NFNL_MSG_BATCH_END, 0, NFNL_SUBSYS_NFTABLES));
+}
+
+// nftables takes numbers in network byte order.
+void addNftAttr(NetlinkRequest& request, uint16_t type, uint32_t value) {
+  addNetlinkAttr(request, type, htonl(value));
+}
+
+// Adds an expression named `name` with the given attributes to a rule.
+void addNftExpr(
+    NetlinkRequest& request,
+    const std::string& name,
+    const std::vector<std::pair<uint16_t, uint32_t>>& attrs) {
+  size_t elem = beginNetlinkNest(request, NFTA_LIST_ELEM);
+  addNetlinkAttr(request, NFTA_EXPR_NAME, name);
+  size_t data = beginNetlinkNest(request, NFTA_EXPR_DATA);
+  for (const auto& attr : attrs) {
+    addNftAttr(request, attr.first, attr.second);
+  }
+  endNetlinkNest(request, data);
+  endNetlinkNest(request, elem);
+}
+
+// Adds a chain of the nat table at hook, with the rule that DNATs packets to
+// local addresses through the port map:
+//   fib daddr type local dnat ip to meta l4proto . th dport map @ports
+// The key and the data of the map are concatenations of two 4-byte
+// registers each.
+void addNftPublishChain(
+    NetlinkRequest& request,
+    const std::string& name,
+    uint32_t hook) {
+  size_t msg = beginNftMessage(
+      request, NFT_MSG_NEWCHAIN, NLM_F_CREATE | NLM_F_ACK);
+  addNetlinkAttr(request, NFTA_CHAIN_TABLE, kNftTable);
+  addNetlinkAttr(request, NFTA_CHAIN_NAME, name);
+  addNetlinkAttr(request, NFTA_CHAIN_TYPE, std::string("nat"));
+  size_t hookNest = beginNetlinkNest(request, NFTA_CHAIN_HOOK);
+  addNftAttr(request, NFTA_HOOK_HOOKNUM, hook);
+  addNftAttr(request, NFTA_HOOK_PRIORITY, NF_IP_PRI_NAT_DST);
+  endNetlinkNest(request, hookNest);
+  endNetlinkMessage(request, msg);
+
+  msg = beginNftMessage(
+      request, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK);
+  addNetlinkAttr(request, NFTA_RULE_TABLE, kNftTable);
+  addNetlinkAttr(request, NFTA_RULE_CHAIN, name);
+  size_t exprs = beginNetlinkNest(request, NFTA_RULE_EXPRESSIONS);
+  addNftExpr(request, "fib", {
+      {NFTA_FIB_DREG, NFT_REG_1},
+      {NFTA_FIB_RESULT, NFT_FIB_RESULT_ADDRTYPE},
+      {NFTA_FIB_FLAGS, NFTA_FIB_F_DADDR}});
+  size_t elem = beginNetlinkNest(request, NFTA_LIST_ELEM);
+  addNetlinkAttr(request, NFTA_EXPR_NAME, std::string("cmp"));
+  size_t data = beginNetlinkNest(request, NFTA_EXPR_DATA);
+  addNftAttr(request, NFTA_CMP_SREG, NFT_REG_1);
+  addNftAttr(request, NFTA_CMP_OP, NFT_CMP_EQ);
+  size_t value = beginNetlinkNest(request, NFTA_CMP_DATA);
+  // The address type is stored in host byte order.
+  addNetlinkAttr(request, NFTA_DATA_VALUE, uint32_t(RTN_LOCAL));
+  endNetlinkNest(request, value);
+  endNetlinkNest(request, data);
+  endNetlinkNest(request, elem);
+  addNftExpr(request, "meta", {
+      {NFTA_META_KEY, NFT_META_L4PROTO},
+      {NFTA_META_DREG, NFT_REG32_00}});
+  addNftExpr(request, "payload", {
+      {NFTA_PAYLOAD_DREG, NFT_REG32_01},
+      {NFTA_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER},
+      {NFTA_PAYLOAD_OFFSET, 2},
+      {NFTA_PAYLOAD_LEN, 2}});
+  elem = beginNetlinkNest(request, NFTA_LIST_ELEM);
+  addNetlinkAttr(request, NFTA_EXPR_NAME, std::string("lookup"));
+  data = beginNetlinkNest(request, NFTA_EXPR_DATA);
+  addNetlinkAttr(request, NFTA_LOOKUP_SET, kNftPortMap);
+  addNftAttr(request, NFTA_LOOKUP_SET_ID, 1);
+  addNftAttr(request, NFTA_LOOKUP_SREG, NFT_REG32_00);
+  addNftAttr(request, NFTA_LOOKUP_DREG, NFT_REG32_02);
+  endNetlinkNest(request, data);
+  endNetlinkNest(request, elem);
+  addNftExpr(request, "nat", {
+      {NFTA_NAT_TYPE, NFT_NAT_DNAT},
+      {NFTA_NAT_FAMILY, NFPROTO_IPV4},
+      {NFTA_NAT_REG_ADDR_MIN, NFT_REG32_02},
+      {NFTA_NAT_REG_PROTO_MIN, NFT_REG32_03}});
+  endNetlinkNest(request, exprs);
+  endNetlinkMessage(request, msg);
+}
+
+// Called in parent (agent) process.
+// Creates the nat table of published ports, unless it exists: a hash map
+// from protocol and host port to container address and port, looked up by
+// one rule in prerouting, and in output for connections from the host. The
+// table is created with NLM_F_EXCL, so the whole batch fails with EEXIST
+// once another agent created it.
+bool createNftPortMap() {
+  NetlinkRequest request;
+  addNftBatchBegin(request);
+  size_t msg = beginNftMessage(
+      request, NFT_MSG_NEWTABLE, NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK);
+  addNetlinkAttr(request, NFTA_TABLE_NAME, kNftTable);
+  endNetlinkMessage(request, msg);
+
+  msg = beginNftMessage(request, NFT_MSG_NEWSET, NLM_F_CREATE | NLM_F_ACK);
+  addNetlinkAttr(request, NFTA_SET_TABLE, kNftTable);
+  addNetlinkAttr(request, NFTA_SET_NAME, kNftPortMap);
+  addNftAttr(request, NFTA_SET_ID, 1);
+  addNftAttr(request, NFTA_SET_FLAGS, NFT_SET_MAP);
+  // The types are only for "nft list": inet_proto . inet_service, mapped to
+  // ipv4_addr . inet_service.
+  addNftAttr(request, NFTA_SET_KEY_TYPE, 12 << 6 | 13);
+  addNftAttr(request, NFTA_SET_KEY_LEN, 8);
+  addNftAttr(request, NFTA_SET_DATA_TYPE, 7 << 6 | 13);
+  addNftAttr(request, NFTA_SET_DATA_LEN, 8);
+  endNetlinkMessage(request, msg);
+
+  addNftPublishChain(request, "prerouting", NF_INET_PRE_ROUTING);
+  addNftPublishChain(request, "output", NF_INET_LOCAL_OUT);
+  addNftBatchEnd(request);
+  int err = sendNetlinkRequest(NETLINK_NETFILTER, request);
+  if (err != 0 && err != -EEXIST) {
+    errno = -err;
+    perror("[Agent] nftables(create port map)");
+    return false;
+  }
+  return true;
+}
+
+// The key of a port in the map, protocol . port, each padded to 4 bytes.
+std::array<uint8_t, 8> getNftPortKey(uint8_t protocol, uint16_t port) {
+  std::array<uint8_t, 8> key = {};
+  key[0] = protocol;
+  port = htons(port);
+  memcpy(&key[4], &port, sizeof(port));
+  return key;
+}
+
+// Adds or deletes the elements of the port map for the ports of a container,
+// all in one message.
+int updateNftPortMap(
+    uint16_t type,
+    uint16_t flags,
+    uint32_t addr,
+    const std::vector<PortMapping>& ports) {
+  NetlinkRequest request;
+  addNftBatchBegin(request);
+  size_t msg = beginNftMessage(request, type, flags | NLM_F_ACK);
+  addNetlinkAttr(request, NFTA_SET_ELEM_LIST_TABLE, kNftTable);
+  addNetlinkAttr(request, NFTA_SET_ELEM_LIST_SET, kNftPortMap);
+  size_t elems = beginNetlinkNest(request, NFTA_SET_ELEM_LIST_ELEMENTS);
+  for (const auto& port : ports) {
+    size_t elem = beginNetlinkNest(request, NFTA_LIST_ELEM);
+    size_t key = beginNetlinkNest(request, NFTA_SET_ELEM_KEY);
+    addNetlinkAttr(
+        request, NFTA_DATA_VALUE, getNftPortKey(port.protocol, port.hostPort));
+    endNetlinkNest(request, key);
+    if (type == NFT_MSG_NEWSETELEM) {
+      std::array<uint8_t, 8> value = {};
+      const uint32_t addrBe = htonl(addr);
+      const uint16_t portBe = htons(port.containerPort);
+      memcpy(&value[0], &addrBe, sizeof(addrBe));
+      memcpy(&value[4], &portBe, sizeof(portBe));
+      size_t data = beginNetlinkNest(request, NFTA_SET_ELEM_DATA);
+      addNetlinkAttr(request, NFTA_DATA_VALUE, value);
+      endNetlinkNest(request, data);
+    }
+    endNetlinkNest(request, elem);
+  }
+  endNetlinkNest(request, elems);
+  endNetlinkMessage(request, msg);
+  addNftBatchEnd(request);
+  return sendNetlinkRequest(NETLINK_NETFILTER, request);
+}
+
+// Called in parent (agent) process.
+// Publishes the ports of the container at ip. Packets are DNATed in the
+// kernel, and publishing or unpublishing only changes elements of the map.
+bool publishPorts(
+    const std::string& ip,
+    const std::vector<PortMapping>& ports) {
+  uint32_t addr;
+  if (!parseIp(ip, addr) || !createNftPortMap()) {
+    return false;
+  }
+  int err = updateNftPortMap(
+      NFT_MSG_NEWSETELEM, NLM_F_CREATE | NLM_F_EXCL, addr, ports);
+  if (err == -EEXIST) {
+    std::cerr << "Error: A host port is already published" << std::endl;
+    return false;
+  }
+  if (err != 0) {
+    errno = -err;
+    perror("[Agent] nftables(publish ports)");
+    return false;
+  }
+  return true;
+}
+
+// Called in parent (agent) process.
+void unpublishPorts(const std::vector<PortMapping>& ports) {
+  int err = updateNftPortMap(NFT_MSG_DELSETELEM, 0, 0, ports);
+  if (err != 0) {
+    errno = -err;
+    perror("[Agent] nftables(unpublish ports)");
+  }
+}
+
+// Reads the host port, and the container address, of an element of the port
+// map. Returns false if it isn't one.
+bool parseNftPortElement(
+    const struct nlattr* elem,
+    PortMapping& mapping,
+    uint32_t& addr) {
+  std::array<uint8_t, 8> key, data;
+  const struct nlattr* attrs[2] = {
+      findNetlinkAttr(
+          getNetlinkAttrData(elem),
+          getNetlinkAttrLength(elem),
+          NFTA_SET_ELEM_KEY),
+      findNetlinkAttr(
+          getNetlinkAttrData(elem),
+          getNetlinkAttrLength(elem),
+          NFTA_SET_ELEM_DATA)};
+  std::array<uint8_t, 8>* values[2] = {&key, &data};
+  for (int i = 0; i < 2; ++i) {
+    const struct nlattr* value = attrs[i] == nullptr ? nullptr :
+        findNetlinkAttr(
+            getNetlinkAttrData(attrs[i]),
+            getNetlinkAttrLength(attrs[i]),
+            NFTA_DATA_VALUE);
+    if (value == nullptr || getNetlinkAttrLength(value) != values[i]->size()) {
+      return false;
+    }
+    memcpy(values[i]->data(), getNetlinkAttrData(value), values[i]->size());
+  }
+  uint16_t port;
+  memcpy(&port, &key[4], sizeof(port));
+  memcpy(&addr, &data[0], sizeof(addr));
+  mapping.protocol = key[0];
+  mapping.hostPort = ntohs(port);
+  addr = ntohl(addr);
+  return true;
+}
+
+// Unpublishes the ports whose container address matches. Returns how many
+// were unpublished.
+size_t unpublishPortsIf(const std::function<bool(uint32_t addr)>& match) {
+  NetlinkRequest request;
+  size_t msg = beginNftMessage(
+      request, NFT_MSG_GETSETELEM, NLM_F_DUMP | NLM_F_ACK);
+  addNetlinkAttr(request, NFTA_SET_ELEM_LIST_TABLE, kNftTable);
+  addNetlinkAttr(request, NFTA_SET_ELEM_LIST_SET, kNftPortMap);
+  endNetlinkMessage(request, msg);
+  std::map<uint32_t, std::vector<PortMapping>> stale;
+  auto onElem = [&match, &stale](const struct nlattr* elem) {
+    PortMapping mapping;
+    uint32_t addr;
+    if (parseNftPortElement(elem, mapping, addr) && match(addr)) {
+      stale[addr].push_back(mapping);
+    }
+  };
+  int err = sendNetlinkRequest(
+      NETLINK_NETFILTER, request, [&onElem](const struct nlmsghdr* nlh) {
+        const struct nlattr* elems = findNetlinkAttr(
+            static_cast<const char*>(NLMSG_DATA(nlh)) +
+                NLMSG_ALIGN(sizeof(struct nfgenmsg)),
+            nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg)),
+            NFTA_SET_ELEM_LIST_ELEMENTS);
+        if (elems != nullptr) {
+          forEachNetlinkAttr(
+              getNetlinkAttrData(elems), getNetlinkAttrLength(elems), onElem);
+        }
+      });
+  if (err == -ENOENT) {
+    // No port was ever published.
+    return 0;
+  }
+  if (err != 0) {
+    errno = -err;
+    perror("nftables(list ports)");
+    return 0;
+  }
+  size_t unpublished = 0;
+  for (const auto& ports : stale) {
+    unpublishPorts(ports.second);
+    unpublished += ports.second.size();
+  }
+  return unpublished;
+}
+
+// Unpublishes the ports whose container address isn't held anymore, because
+// its agent died. Returns how many were unpublished.
+size_t collectPorts(Ipam& ipam) {
+  return unpublishPortsIf([&ipam](uint32_t addr) {
+    const uint32_t index = addr - ipam.header->subnet;
+    return index < ipam.header->size &&
+        !(ipam.bitmap[index / 64].load() & (1ull << (index % 64)));
+  });
+}
+
+// Called in parent (agent) process.
+// Unpublishes the ports left published to an address by an agent that died,
+// whose address was collected by another agent before gc ran. Otherwise the
+// new container at the address would receive them.
+void collectPortsOf(const std::string& ip) {
+  uint32_t ipAddr;
+  if (parseIp(ip, ipAddr)) {
+    unpublishPortsIf([ipAddr](uint32_t addr) { return addr == ipAddr; });
+  }
+}
+
+long bpf(int cmd, union bpf_attr& attr) {
+  return syscall(SYS_bpf, cmd, &attr, sizeof(attr));
+}
+
+struct bpf_insn makeBpfInsn(
+    uint8_t code,
+    uint8_t dst,
+    uint8_t src,
+    int16_t off,
+    int32_t imm) {
+  struct bpf_insn insn = {};
+  insn.code = code;
+  insn.dst_reg = dst;
+  insn.src_reg = src;
+  insn.off = off;
+  insn.imm = imm;
+  return insn;
+}
+
+// Called in parent (agent) process.
+// Returns an fd of the map of the fast path, or -1 if it doesn't exist and
+// create is false. The first agent mounts a bpf filesystem at kBpfRoot and
+// pins the map there, so that it is shared by all agents.
+int openFastPathMap(bool create) {
+  union bpf_attr attr = {};
+  attr.pathname = reinterpret_cast<uint64_t>(kFastPathMapPath.c_str());
+  int mapfd = bpf(BPF_OBJ_GET, attr);
+  if (mapfd != -1 || !create) {
+    return mapfd;
+  }
+
+  const std::string lockPath = kBpfRoot + ".lock";
+  int lockfd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lockfd == -1 || flock(lockfd, LOCK_EX) == -1) {
+    errExit("flock(bpf.lock)");
+  }
+  mapfd = bpf(BPF_OBJ_GET, attr);
+  if (mapfd == -1) {
+    if (mkdir(kBpfRoot.c_str(), 0700) == -1 && errno != EEXIST) {
+      errExit("mkdir(kBpfRoot)");
+    }
+    struct statfs fs;
+    if ((statfs(kBpfRoot.c_str(), &fs) == -1 || fs.f_type != BPF_FS_MAGIC) &&
+        mount("bpf", kBpfRoot.c_str(), "bpf", 0, "mode=0700") == -1) {
+      errExit("mount(bpf)");
+    }
+    // A slot for every address of the bridge network.
+    attr = {};
+    attr.map_type = BPF_MAP_TYPE_HASH;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 1u << (32 - std::stoi(kDefaultBridgePrefixLen));
+    strncpy(attr.map_name, "fast_path", sizeof(attr.map_name) - 1);
+    mapfd = bpf(BPF_MAP_CREATE, attr);
+    if (mapfd == -1) {
+      errExit("bpf(BPF_MAP_CREATE)");
+    }
+    attr = {};
+    attr.pathname = reinterpret_cast<uint64_t>(kFastPathMapPath.c_str());
+    attr.bpf_fd = mapfd;
+    if (bpf(BPF_OBJ_PIN, attr) == -1) {
+      errExit("bpf(BPF_OBJ_PIN)");
+    }
+  }
+  close(lockfd);
+  return mapfd;
+}
+
+// Called in parent (agent) process.
+// Loads the TC program of the fast path, for the ingress of the veth of a
+// container, which sees what the container sends. An IPv4 packet to an
+// address in the map is redirected to the peer of the veth found there, the
+// eth0 of another container, as if it had been received there. It skips the
+// bridge, the netfilter hooks and the backlog of the host. Anything else
+// passes on as usual.
+int loadFastPathProgram(int mapfd) {
+  const int32_t ethIpOffset = sizeof(struct ethhdr);
+  std::vector<struct bpf_insn> code = {
+      // r2 = skb->data, r3 = skb->data_end
+      makeBpfInsn(
+          BPF_LDX | BPF_MEM | BPF_W,
+          BPF_REG_2,
+          BPF_REG_1,
+          offsetof(struct __sk_buff, data),
+          0),
+      makeBpfInsn(
+          BPF_LDX | BPF_MEM | BPF_W,
+          BPF_REG_3,
+          BPF_REG_1,
+          offsetof(struct __sk_buff, data_end),
+          0),
+      // if r2 + Ethernet and IPv4 headers > r3 goto pass
+      makeBpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+      makeBpfInsn(
+          BPF_ALU64 | BPF_ADD | BPF_K,
+          BPF_REG_4,
+          0,
+          0,
+          ethIpOffset + sizeof(struct iphdr)),
+      makeBpfInsn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0),
+      // if h_proto != ETH_P_IP goto pass
+      makeBpfInsn(
+          BPF_LDX | BPF_MEM | BPF_H,
+          BPF_REG_4,
+          BPF_REG_2,
+          offsetof(struct ethhdr, h_proto),
+          0),
+      makeBpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0, htons(ETH_P_IP)),
+      // r0 = lookup(map, &daddr)
+      makeBpfInsn(
+          BPF_LDX | BPF_MEM | BPF_W,
+          BPF_REG_4,
+          BPF_REG_2,
+          ethIpOffset + offsetof(struct iphdr, daddr),
+          0),
+      makeBpfInsn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -4, 0),
+      makeBpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+      makeBpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+      makeBpfInsn(
+          BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapfd),
+      makeBpfInsn(0, 0, 0, 0, 0),
+      makeBpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+      // if r0 == NULL goto pass
+      makeBpfInsn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0),
+      // return redirect_peer(*r0, 0)
+      makeBpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_0, 0, 0),
+      makeBpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0),
+      makeBpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_peer),
+      makeBpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)};
+  // pass: return TC_ACT_OK, where all the conditional jumps above go.
+  const int16_t pass = code.size();
+  for (size_t i = 0; i < code.size(); i++) {
+    const uint8_t op = BPF_OP(code[i].code);
+    if (BPF_CLASS(code[i].code) == BPF_JMP && op != BPF_CALL &&
+        op != BPF_EXIT) {
+      code[i].off = pass - i - 1;
+    }
+  }
+  code.push_back(
+      makeBpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, TC_ACT_OK));
+  code.push_back(makeBpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+  std::vector<char> log(64 * 1024);
+  union bpf_attr attr = {};
+  attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+  attr.insns = reinterpret_cast<uint64_t>(code.data());
+  attr.insn_cnt = code.size();
+  attr.license = reinterpret_cast<uint64_t>("GPL");
+  attr.log_buf = reinterpret_cast<uint64_t>(log.data());
+  attr.log_size = log.size();
+  attr.log_level = 1;
+  strncpy(attr.prog_name, "fast_path", sizeof(attr.prog_name) - 1);
+  int progfd = bpf(BPF_PROG_LOAD, attr);
+  if (progfd == -1) {
+    perror("[Agent] bpf(BPF_PROG_LOAD)");
+    std::cerr << log.data() << std::endl;
+  }
+  return progfd;
+}
+
+// Called in parent (agent) process.
+// Attaches a direct action TC program to the ingress of an interface, on a
+// clsact qdisc.
+bool attachTcProgram(const std::string& ifname, int progfd) {
+  struct tcmsg header = {};
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = if_nametoindex(ifname.c_str());
+  header.tcm_handle = TC_H_MAKE(TC_H_CLSACT, 0);
+  header.tcm_parent = TC_H_CLSACT;
+  if (header.tcm_ifindex == 0) {
+    perror(("if_nametoindex(" + ifname + ")").c_str());
+    return false;
+  }
+  NetlinkRequest request;
+  size_t msg = beginNetlinkMessage(
+      request,
+      RTM_NEWQDISC,
+      NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK,
+      &header,
+      sizeof(header));
+  addNetlinkAttr(request, TCA_KIND, std::string("clsact"));
+  endNetlinkMessage(request, msg);
+
+  header.tcm_handle = 0;
+  header.tcm_parent = TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS);
+  header.tcm_info = TC_H_MAKE(1 << 16, htons(ETH_P_IP));
+  msg = beginNetlinkMessage(
+      request,
+      RTM_NEWTFILTER,
+      NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK,
+      &header,
+      sizeof(header));
+  addNetlinkAttr(request, TCA_KIND, std::string("bpf"));
+  size_t options = beginNetlinkNest(request, TCA_OPTIONS);
+  addNetlinkAttr(request, TCA_BPF_FD, static_cast<uint32_t>(progfd));
+  addNetlinkAttr(request, TCA_BPF_NAME, std::string("fast_path"));
+  addNetlinkAttr(
+      request, TCA_BPF_FLAGS, static_cast<uint32_t>(TCA_BPF_FLAG_ACT_DIRECT));
+  endNetlinkNest(request, options);
+  endNetlinkMessage(request, msg);
+  int err = sendNetlinkRequest(NETLINK_ROUTE, request);
+  if (err != 0) {
+    errno = -err;
+    perror(("[Agent] tc(" + ifname + ", bpf)").c_str());
+    return false;
+  }
+  return true;
+}
+
+// Called in parent (agent) process.
+// Puts a container on the fast path: what it sends to other containers on
+// the fast path goes straight into their network namespace, and what they
+// send to it into its own.
+bool enableFastPath(int cpid, const std::string& ip) {
+  const std::string vethName = "veth" + std::to_string(cpid);
+  int mapfd = openFastPathMap(true);
+  int progfd = loadFastPathProgram(mapfd);
+  bool success = progfd != -1 && attachTcProgram(vethName, progfd);
+  if (success) {
+    struct in_addr key;
+    inet_pton(AF_INET, ip.c_str(), &key);
+    const uint32_t ifindex = if_nametoindex(vethName.c_str());
+    union bpf_attr attr = {};
+    attr.map_fd = mapfd;
+    attr.key = reinterpret_cast<uint64_t>(&key.s_addr);
+    attr.value = reinterpret_cast<uint64_t>(&ifindex);
+    attr.flags = BPF_ANY;
+    if (bpf(BPF_MAP_UPDATE_ELEM, attr) == -1) {
+      perror("[Agent] bpf(BPF_MAP_UPDATE_ELEM)");
+      success = false;
+    }
+  }
+  if (progfd != -1) {
+    close(progfd);
+  }
+  close(mapfd);
+  return success;
+}
+
+// Called in parent (agent) process.
+// Takes the address of a container off the fast path, if it was on it,
+// including when it was left there by an agent that died.
+void disableFastPath(const std::string& ip) {
+  int mapfd = openFastPathMap(false);
+  if (mapfd == -1) {
+    return;
+  }
+  struct in_addr key;
+  inet_pton(AF_INET, ip.c_str(), &key);
+  union bpf_attr attr = {};
+  attr.map_fd = mapfd;
+  attr.key = reinterpret_cast<uint64_t>(&key.s_addr);
+  bpf(BPF_MAP_DELETE_ELEM, attr);
+  close(mapfd);
+}
+
+// Called in parent (agent) process.
+// Takes the addresses that are no longer held off the fast path, and returns
+// how many.
+size_t collectFastPath(Ipam& ipam) {
+  int mapfd = openFastPathMap(false);
+  if (mapfd == -1) {
+    return 0;
+  }
+  std::vector<uint32_t> stale;
+  uint32_t key;
+  union bpf_attr attr = {};
+  attr.map_fd = mapfd;
+  attr.key = 0;
+  attr.next_key = reinterpret_cast<uint64_t>(&key);
+  while (bpf(BPF_MAP_GET_NEXT_KEY, attr) == 0) {
+    const uint32_t index = ntohl(key) - ipam.header->subnet;
+    if (index >= ipam.header->size ||
+        !(ipam.bitmap[index / 64].load() & (1ull << (index % 64)))) {
+      stale.push_back(key);
+    }
+    attr.key = reinterpret_cast<uint64_t>(&key);
+  }
+  for (uint32_t& addr : stale) {
+    attr = {};
+    attr.map_fd = mapfd;
+    attr.key = reinterpret_cast<uint64_t>(&addr);
+    bpf(BPF_MAP_DELETE_ELEM, attr);
+  }
+  close(mapfd);
+  return stale.size();
+}
+
+// A minimal io_uring, set up with the raw syscalls. The agent batches its
+// small I/O into one io_uring_enter() where the kernel supports io_uring.
+struct IoUring {
+  int fd;
+  // The mappings of the rings and of the submission queue entries.
+  void* rings;
+  size_t ringsSize;
+  struct io_uring_sqe* sqes;
+  size_t sqesSize;
+  // Submission queue.
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned* sqArray;
+  // Entries filled in but not submitted yet.
+  unsigned sqPending;
+  // Completion queue.
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+  IoUring()
+      : fd(-1), rings(MAP_FAILED), ringsSize(0), sqes(nullptr), sqesSize(0),
+        sqHead(nullptr), sqTail(nullptr), sqMask(0), sqArray(nullptr),
+        sqPending(0), cqHead(nullptr), cqTail(nullptr), cqMask(0),
+        cqes(nullptr) {}
+};
+
+void closeIoUring(IoUring& ring) {
+  if (ring.sqes != nullptr) {
+    munmap(ring.sqes, ring.sqesSize);
+  }
+  if (ring.rings != MAP_FAILED) {
+    munmap(ring.rings, ring.ringsSize);
+  }
+  if (ring.fd != -1) {
+    close(ring.fd);
+  }
+  ring = IoUring();
+}
+
+// Sets up an io_uring with a table of `files` registered files, all empty.
+// Returns false if io_uring isn't available, e.g. on old kernels or when it
+// is disabled by sysctl or seccomp, and the caller falls back to plain
+// syscalls.
+bool setupIoUring(unsigned entries, unsigned files, IoUring& ring) {
+  struct io_uring_params params = {};
+  ring.fd = syscall(SYS_io_uring_setup, entries, &params);
+  if (ring.fd == -1) {
+    return false;
+  }
+  // Kernels before 5.4 map the completion queue separately, which isn't
+  // worth supporting.
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    closeIoUring(ring);
+    return false;
+  }
+  ring.ringsSize = std::max(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  ring.rings = mmap(
+      nullptr, ring.ringsSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(
+      nullptr, ring.sqesSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (ring.rings == MAP_FAILED || sqes == MAP_FAILED) {
+    errExit("mmap(io_uring)");
+  }
+  ring.sqes = static_cast<struct io_uring_sqe*>(sqes);
+  char* base = static_cast<char*>(ring.rings);
+  ring.sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+  ring.sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+  ring.sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+  ring.sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+  ring.cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+  ring.cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+  ring.cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+  ring.cqes =
+      reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+  if (files > 0) {
+    std::vector<int> fds(files, -1);
+    if (syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_FILES,
+                fds.data(), files) == -1) {
+      closeIoUring(ring);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Puts fd into slot `index` of the registered files, or empties the slot
+// with -1.
+void registerIoUringFile(IoUring& ring, unsigned index, int fd) {
+  struct io_uring_files_update update = {};
+  update.offset = index;
+  update.fds = reinterpret_cast<uintptr_t>(&fd);
+  if (syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_FILES_UPDATE,
+              &update, 1) == -1) {
+    errExit("io_uring_register(files)");
+  }
+}
+
+// Submits everything queued so far and waits for at least waitNr
+// completions.
+void submitIoUring(IoUring& ring, unsigned waitNr) {
+  for (;;) {
+    int n = syscall(
+        SYS_io_uring_enter, ring.fd, ring.sqPending, waitNr,
+        waitNr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (n >= 0) {
+      ring.sqPending -= n;
+      return;
+    }
+    if (errno != EINTR) {
+      errExit("io_uring_enter");
+    }
+  }
+}
+
+// Returns the next free submission queue entry, cleared, submitting what is
+// queued when the queue is full.
+struct io_uring_sqe* getIoUringSqe(IoUring& ring) {
+  unsigned tail = *ring.sqTail;
+  if (tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) > ring.sqMask) {
+    submitIoUring(ring, 0);
+  }
+  struct io_uring_sqe* sqe = &ring.sqes[tail & ring.sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sqArray[tail & ring.sqMask] = tail & ring.sqMask;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++ring.sqPending;
+  return sqe;
+}
+
+// Takes the next completion, if there is one.
+bool nextIoUringCqe(IoUring& ring, struct io_uring_cqe& cqe) {
+  unsigned head = *ring.cqHead;
+  if (head == __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  cqe = ring.cqes[head & ring.cqMask];
+  __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool writeToFile(const std::string& file, const std::string& data) {
+  std::ofstream ofs(file);
+  if (ofs.is_open()) {
+    ofs << data;
+    // Files like uid_map and cgroup files only reject the write when it is
+    // flushed.
+    ofs.close();
+    if (ofs.fail()) {
+      std::cout << "Error: Failed to write " << file << std::endl;
+      return false;
+    }
+  } else {
+    std::cout << "Error: Failed to open " << file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Called in parent (agent) process.
+// Maps the container's uids and gids to the host range. The agent is
+// privileged in the parent user namespace, so setgroups() stays allowed.
+bool writeIdMaps(int cpid, const IdMapping& mapping) {
+  const std::string procPath = "/proc/" + std::to_string(cpid);
+  const std::string map =
+      "0 " + std::to_string(mapping.hostId) + " " +
+      std::to_string(mapping.count);
+  return writeToFile(procPath + "/uid_map", map) &&
+      writeToFile(procPath + "/gid_map", map);
+}
+
+std::string getContainerCgroup(int cpid) {
+  return kCgroupRoot + std::to_string(cpid);
+}
+
+// Called in parent (agent) process.
+// Creates a cgroup and writes its files in order, stopping at the first
+// failure. With io_uring, all of it is one chain of linked mkdirat, and
+// openat, write and close per file, submitted with one io_uring_enter(). The
+// files are opened as direct descriptors into registered file slot 0, so the
+// write and close can refer to them before they are open.
+bool writeCgroupFiles(
+    const std::string& cgroupPath,
+    const std::vector<std::pair<std::string, std::string>>& files) {
+  std::vector<std::string> paths;
+  for (const auto& file : files) {
+    paths.push_back(cgroupPath + "/" + file.first);
+  }
+  IoUring uring;
+  const unsigned count = 1 + 3 * files.size();
+  if (setupIoUring(count, 1, uring)) {
+    struct io_uring_sqe* sqe = getIoUringSqe(uring);
+    sqe->opcode = IORING_OP_MKDIRAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uintptr_t>(cgroupPath.c_str());
+    sqe->len = 0755;
+    for (size_t i = 0; i < files.size(); ++i) {
+      sqe = getIoUringSqe(uring);
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = reinterpret_cast<uintptr_t>(paths[i].c_str());
+      sqe->open_flags = O_WRONLY;
+      sqe->file_index = 1;
+      sqe->user_data = i;
+      sqe = getIoUringSqe(uring);
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+      sqe->fd = 0;
+      sqe->addr = reinterpret_cast<uintptr_t>(files[i].second.data());
+      sqe->len = files[i].second.size();
+      sqe->user_data = i;
+      sqe = getIoUringSqe(uring);
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->flags = i + 1 < files.size() ? IOSQE_IO_LINK : 0;
+      sqe->file_index = 1;
+      sqe->user_data = i;
+    }
+    submitIoUring(uring, count);
+    bool success = true;
+    bool supported = true;
+    struct io_uring_cqe cqe;
+    for (unsigned i = 0; i < count && nextIoUringCqe(uring, cqe); ++i) {
+      if (cqe.res >= 0 || cqe.res == -ECANCELED || !success) {
+        continue;
+      }
+      success = false;
+      errno = -cqe.res;
+      if (i > 0) {
+        std::cout << "Error: Failed to write " << paths[cqe.user_data]
+                  << ": " << strerror(errno) << std::endl;
+      } else if (errno == EINVAL) {
+        // Kernels before 5.15 have io_uring without these operations.
+        supported = false;
+      } else {
+        perror("mkdirat(cgroupPath)");
+      }
+    }
+    closeIoUring(uring);
+    if (supported) {
+      return success;
+    }
+  }
+
+  if (mkdir(cgroupPath.c_str(), 0755) == -1) {
+    perror("mkdir(cgroupPath.c_str(), 0755)");
+    return false;
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (!writeToFile(paths[i], files[i].second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool setupCgroup(int cpid, const ResourceLimit& limit) {
+  // (1) Create a cgroup at <root>/<cpid>
+  const std::string cgroupPath = getContainerCgroup(cpid);
+  std::vector<std::pair<std::string, std::string>> files;
+
+  // (2) Set up resource limit
+  // Memory
+  if (limit.maxRamBytes > 0) {
+    // Try not to reclaim before hitting 75% of the max limit
+    int memoryLow = limit.maxRamBytes * 75 / 100;
+    int memoryMax = limit.maxRamBytes;
+    files.emplace_back("memory.low", std::to_string(memoryLow));
+    files.emplace_back("memory.max", std::to_string(memoryMax));
+  }
+
+  // (3) Move the container process to the cgroup
+  files.emplace_back("cgroup.procs", std::to_string(cpid));
+  return writeCgroupFiles(cgroupPath, files);
+}
+
+void removeCgroup(const std::string& cgroupPath) {
+  if (rmdir(cgroupPath.c_str()) == -1) {
+    errExit("rmdir(cgroupPath)");
+  }
+}
+
+std::string getContainerStateDir(const std::string& id) {
+  return kContainerStateRoot + id;
+}
+
+// Called in parent (agent) process.
+// Reserves the state directory of a container, which makes its name unique
+// on the host. Returns false if a container of that name is running.
+bool reserveContainerState(const std::string& id) {
+  for (const auto& dir : {kStateRoot, kContainerStateRoot}) {
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+      errExit("mkdir(kStateRoot)");
+    }
+  }
+  const std::string stateDir = getContainerStateDir(id);
+  if (mkdir(stateDir.c_str(), 0755) == 0) {
+    return true;
+  }
+  if (errno != EEXIST) {
+    errExit("mkdir(stateDir)");
+  }
+  // Take over the state of a container whose agent died without removing it.
+  const std::string pid = readFirstLine(stateDir + "/pid");
+  return !pid.empty() && kill(std::stoi(pid), 0) == -1 && errno == ESRCH;
+}
+
+bool writeContainerState(const std::string& id, int cpid) {
+  return writeToFile(
+      getContainerStateDir(id) + "/pid", std::to_string(cpid) + "\n");
+}
+
+void removeContainerState(const std::string& id) {
+  const std::string stateDir = getContainerStateDir(id);
+  unlink((stateDir + "/pid").c_str());
+  unlink((stateDir + "/log.ring").c_str());
+  unlink((stateDir + "/attach.sock").c_str());
+  unlink((stateDir + "/seccomp.bpf").c_str());
+  if (rmdir(stateDir.c_str()) == -1) {
+    perror("rmdir(stateDir)");
+  }
+}
+
+// Called in parent (agent) process.
+// Saves the seccomp filter of a container, which "exec" installs in its
+// commands too. It is written before the pid, so that no command can be
+// exec'd into the container before it is there.
+bool writeSeccompState(
+    const std::string& id,
+    const std::vector<struct sock_filter>& filter) {
+  std::ofstream ofs(
+      getContainerStateDir(id) + "/seccomp.bpf", std::ios::binary);
+  ofs.write(
+      reinterpret_cast<const char*>(filter.data()),
+      filter.size() * sizeof(struct sock_filter));
+  ofs.close();
+  return ofs.good();
+}
+
+// Reads the seccomp filter of a container, which is left empty if it has
+// none. Returns false if it can't be read.
+bool readSeccompState(
+    const std::string& id,
+    std::vector<struct sock_filter>& filter) {
+  std::ifstream ifs(
+      getContainerStateDir(id) + "/seccomp.bpf", std::ios::binary);
+  if (!ifs.is_open()) {
+    return errno == ENOENT;
+  }
+  struct sock_filter insn;
+  while (ifs.read(reinterpret_cast<char*>(&insn), sizeof(insn))) {
+    filter.push_back(insn);
+  }
+  return ifs.eof() && ifs.gcount() == 0 && !filter.empty();
+}
+
+// Returns a pidfd of the container with the given name or pid. The pid is
+// only taken from the state directory while the container is running, since
+// the agent removes it before the container is reaped. A pid of a process
+// that isn't a container has no state directory, so it isn't found.
+int openContainerPidfd(const std::string& id) {
+  const std::string pid = readFirstLine(getContainerStateDir(id) + "/pid");
+  if (pid.empty() || pid.find_first_not_of("0123456789") != std::string::npos) {
+    errno = ESRCH;
+    return -1;
+  }
+  return syscall(SYS_pidfd_open, std::stoi(pid), 0);
+}
+
+// Parses a comma separated list of namespaces for --join-ns into clone flags.
+bool parseJoinNamespaces(const std::string& list, int& flags) {
+  flags = 0;
+  std::istringstream iss(list);
+  std::string name;
+  while (std::getline(iss, name, ',')) {
+    auto it = std::find_if(
+        kJoinableNamespaces.begin(),
+        kJoinableNamespaces.end(),
+        [&name](const std::pair<std::string, int>& ns) {
+          return ns.first == name;
+        });
+    if (it == kJoinableNamespaces.end()) {
+      return false;
+    }
+    flags |= it->second;
+  }
+  return flags != 0;
+}
+
+// Called in parent (agent) process, e.g. right before clone().
+// Enters the namespaces of a running container, given by a pidfd or by the fd
+// of one namespace, with a single setns() call, e.g. so that the container is
+// created in them. Returns fds of the agent's own namespaces and working
+// directory, for leaveNamespaces().
+std::vector<int> enterNamespaces(int pidfd, int flags) {
+  std::vector<int> savedfds;
+  for (const auto& ns : kJoinableNamespaces) {
+    if (!(flags & ns.second)) {
+      continue;
+    }
+    const std::string nsPath = "/proc/self/ns/" + ns.first;
+    int fd = open(nsPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      errExit("open(/proc/self/ns)");
+    }
+    savedfds.push_back(fd);
+  }
+  // Entering a mount namespace changes the working directory to its root.
+  int cwdfd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwdfd == -1) {
+    errExit("open(cwd)");
+  }
+  savedfds.push_back(cwdfd);
+  if (setns(pidfd, flags) == -1) {
+    errExit("setns(pidfd)");
+  }
+  return savedfds;
+}
+
+// Called in parent (agent) process.
+void leaveNamespaces(const std::vector<int>& savedfds) {
+  for (size_t i = 0; i + 1 < savedfds.size(); ++i) {
+    if (setns(savedfds[i], 0) == -1) {
+      errExit("setns(saved namespace)");
+    }
+    close(savedfds[i]);
+  }
+  if (fchdir(savedfds.back()) == -1) {
+    errExit("fchdir(cwd)");
+  }
+  close(savedfds.back());
+}
+
+// The bandwidth of a container set with --net-rate and --net-burst.
+struct NetShaping {
+  // Bytes per second, or 0 for no shaping.
+  uint64_t rate;
+  // Bytes that may be sent at once above the rate.
+  uint32_t burst;
+  NetShaping() : rate(0), burst(kDefaultNetBurst) {}
+};
+
+// Statistics of the root qdisc of an interface.
+struct QdiscStats {
+  uint64_t bytes;
+  uint32_t packets;
+  uint32_t drops;
+  uint32_t overlimits;
+  QdiscStats() : bytes(0), packets(0), drops(0), overlimits(0) {}
+};
+
+// Called in parent (agent) process, in the network namespace of ifname.
+// Replaces the root qdisc of an interface with a token bucket filter that
+// shapes what it sends to the given rate. Packets that wait longer than
+// kNetQueueLatencyUs are dropped.
+bool shapeInterface(const std::string& ifname, const NetShaping& shaping) {
+  struct tcmsg header = {};
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = if_nametoindex(ifname.c_str());
+  header.tcm_handle = TC_H_MAKE(1 << 16, 0);
+  header.tcm_parent = TC_H_ROOT;
+  if (header.tcm_ifindex == 0) {
+    perror(("if_nametoindex(" + ifname + ")").c_str());
+    return false;
+  }
+  struct tc_tbf_qopt qopt = {};
+  qopt.rate.rate = std::min<uint64_t>(shaping.rate, UINT32_MAX);
+  qopt.rate.linklayer = TC_LINKLAYER_ETHERNET;
+  qopt.limit = shaping.rate * kNetQueueLatencyUs / 1000000 + shaping.burst;
+
+  NetlinkRequest request;
+  size_t msg = beginNetlinkMessage(
+      request,
+      RTM_NEWQDISC,
+      NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK,
+      &header,
+      sizeof(header));
+  addNetlinkAttr(request, TCA_KIND, std::string("tbf"));
+  size_t options = beginNetlinkNest(request, TCA_OPTIONS);
+  addNetlinkAttr(request, TCA_TBF_PARMS, qopt);
+  // The burst in bytes, instead of the time it takes at the rate in ticks.
+  addNetlinkAttr(request, TCA_TBF_BURST, shaping.burst);
+  if (shaping.rate > UINT32_MAX) {
+    addNetlinkAttr(request, TCA_TBF_RATE64, shaping.rate);
+  }
+  endNetlinkNest(request, options);
+  endNetlinkMessage(request, msg);
+  int err = sendNetlinkRequest(NETLINK_ROUTE, request);
+  if (err != 0) {
+    errno = -err;
+    perror(("[Agent] tc(" + ifname + ")").c_str());
+    return false;
+  }
+  return true;
+}
+
+// Called in parent (agent) process, in the network namespace of ifname.
+bool getQdiscStats(const std::string& ifname, QdiscStats& stats) {
+  struct tcmsg header = {};
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = if_nametoindex(ifname.c_str());
+  header.tcm_parent = TC_H_ROOT;
+  if (header.tcm_ifindex == 0) {
+    return false;
+  }
+  // A plain get is answered with a broadcast, so the qdiscs are dumped.
+  NetlinkRequest request;
+  endNetlinkMessage(
+      request,
+      beginNetlinkMessage(
+          request, RTM_GETQDISC, NLM_F_DUMP, &header, sizeof(header)));
+  bool found = false;
+  int err = sendNetlinkRequest(
+      NETLINK_ROUTE, request, [&](const struct nlmsghdr* nlh) {
+        const struct tcmsg* tcm =
+            static_cast<const struct tcmsg*>(NLMSG_DATA(nlh));
+        if (tcm->tcm_ifindex != header.tcm_ifindex ||
+            tcm->tcm_parent != TC_H_ROOT) {
+          return;
+        }
+        const struct nlattr* stats2 = findNetlinkAttr(
+            static_cast<const char*>(NLMSG_DATA(nlh)) +
+                NLMSG_ALIGN(sizeof(struct tcmsg)),
+            nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct tcmsg)),
+            TCA_STATS2);
+        if (stats2 == nullptr) {
+          return;
+        }
+        const struct nlattr* basic = findNetlinkAttr(
+            getNetlinkAttrData(stats2),
+            getNetlinkAttrLength(stats2),
+            TCA_STATS_BASIC);
+        const struct nlattr* queue = findNetlinkAttr(
+            getNetlinkAttrData(stats2),
+            getNetlinkAttrLength(stats2),
+            TCA_STATS_QUEUE);
+        if (basic != nullptr &&
+            getNetlinkAttrLength(basic) >= sizeof(struct gnet_stats_basic)) {
+          struct gnet_stats_basic value;
+          memcpy(&value, getNetlinkAttrData(basic), sizeof(value));
+          stats.bytes = value.bytes;
+          stats.packets = value.packets;
+          found = true;
+        }
+        if (queue != nullptr &&
+            getNetlinkAttrLength(queue) >= sizeof(struct gnet_stats_queue)) {
+          struct gnet_stats_queue value;
+          memcpy(&value, getNetlinkAttrData(queue), sizeof(value));
+          stats.drops = value.drops;
+          stats.overlimits = value.overlimits;
+        }
+      });
+  return err == 0 && found;
+}
+
+// Called in parent (agent) process.
+// Shapes both directions of the network of a container: what the host sends
+// to it on its veth, and what it sends on its eth0, which is configured from
+// the container's network namespace. A macvlan or ipvlan container has no
+// host end to shape, so only what it sends is.
+bool shapeNetwork(
+    int cpid,
+    int netnsFd,
+    const NetworkOptions& network,
+    const NetShaping& shaping) {
+  if (hasVethPair(network) &&
+      !shapeInterface("veth" + std::to_string(cpid), shaping)) {
+    return false;
+  }
+  const std::vector<int> savedNsFds =
+      enterNamespaces(netnsFd, CLONE_NEWNET);
+  const bool success = shapeInterface("eth0", shaping);
+  leaveNamespaces(savedNsFds);
+  return success;
+}
+
+// Called in parent (agent) process, after the container exited.
+// Prints what went through the qdiscs of the container. Its network
+// namespace, and so the veth pair, is kept alive by netnsFd until then.
+void printNetworkStats(int cpid, int netnsFd, const NetworkOptions& network) {
+  const std::string vethName = "veth" + std::to_string(cpid);
+  QdiscStats received, sent;
+  const bool hasReceived =
+      hasVethPair(network) && getQdiscStats(vethName, received);
+  const std::vector<int> savedNsFds =
+      enterNamespaces(netnsFd, CLONE_NEWNET);
+  const bool hasSent = getQdiscStats("eth0", sent);
+  leaveNamespaces(savedNsFds);
+  auto print = [](const char* direction, const QdiscStats& stats) {
+    std::cout << "[Agent] The container " << direction << " " << stats.bytes
+              << " bytes in " << stats.packets << " packets, " << stats.drops
+              << " dropped, " << stats.overlimits << " over the rate"
+              << std::endl;
+  };
+  if (hasReceived) {
+    print("received", received);
+  }
+  if (hasSent) {
+    print("sent", sent);
+  }
+}
+
+// Header of the log ring of a container, a file of a header page followed by
+// the data area. Records are written one after another and never wrap: one
+// that doesn't fit at the end of the data area starts over at the front, after
+// a padding record. Positions count bytes ever written, so a position is at
+// offset position % size of the data area.
+//
+// There is a single writer, the agent. Readers map the file and copy records
+// without any locking or syscalls. A record copied from position p is intact
+// if begin was at most p + size after the copy.
+struct LogRingHeader {
+  uint64_t magic;
+  // Size of the data area.
+  uint64_t size;
+  // End of the last complete record.
+  std::atomic<uint64_t> head;
+  // End of the record being written. Data before begin - size is being or
+  // has been overwritten.
+  std::atomic<uint64_t> begin;
+  // Start of the oldest record that is still intact.
+  std::atomic<uint64_t> tail;
+  // Set once the container has exited and nothing more is written.
+  std::atomic<uint64_t> closed;
+};
+
+// A record in the log ring, followed by its data and padded to a multiple of
+// 16 bytes.
+struct LogRecord {
+  uint32_t length;
+  // 1 for stdout and 2 for stderr, or kLogRecordPadding.
+  uint32_t stream;
+  // Sequence number, from 1. Gaps tell a reader that it fell behind.
+  uint64_t seq;
+};
+
+// The writer side of a log ring.
+struct LogRing {
+  LogRingHeader* header;
+  char* data;
+  uint64_t nextSeq;
+  LogRing() : header(nullptr), data(nullptr), nextSeq(1) {}
+};
+
+uint64_t getLogRecordSize(uint32_t length) {
+  return (sizeof(LogRecord) + length + 15) & ~uint64_t(15);
+}
+
+// Called in parent (agent) process.
+// Creates the log ring of a container and maps it. It holds at least one
+// record of the most data, which is all that is needed for one to fit once
+// the rest of the data area is padded.
+void createLogRing(const std::string& path, size_t size, LogRing& ring) {
+  size = std::max<size_t>(
+      (size + 15) & ~size_t(15), getLogRecordSize(kLogRecordMaxLength));
+  int fd = open(
+      path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1 || ftruncate(fd, kLogRingDataOffset + size) == -1) {
+    errExit("open(log ring)");
+  }
+  void* addr = mmap(
+      nullptr,
+      kLogRingDataOffset + size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      0);
+  if (addr == MAP_FAILED) {
+    errExit("mmap(log ring)");
+  }
+  close(fd);
+  ring.header = new (addr) LogRingHeader();
+  ring.data = static_cast<char*>(addr) + kLogRingDataOffset;
+  ring.header->size = size;
+  ring.header->magic = kLogRingMagic;
+}
+
+// Called in parent (agent) process.
+// Claims the space for a record that ends at end, dropping the oldest
+// records.
+void claimLogRingSpace(LogRing& ring, uint64_t start, uint64_t end) {
+  LogRingHeader* header = ring.header;
+  header->begin.store(end, std::memory_order_relaxed);
+  // Like the writer of a seqlock, readers must see the new begin before any
+  // of the data written over their records.
+  std::atomic_thread_fence(std::memory_order_release);
+  uint64_t tail = header->tail.load(std::memory_order_relaxed);
+  while (tail < header->head.load(std::memory_order_relaxed) &&
+         tail + header->size < end) {
+    const LogRecord* record = reinterpret_cast<const LogRecord*>(
+        ring.data + tail % header->size);
+    tail += getLogRecordSize(record->length);
+  }
+  if (tail + header->size < end) {
+    tail = start;
+  }
+  header->tail.store(tail, std::memory_order_release);
+}
+
+// Called in parent (agent) process.
+// Appends what was just spliced into a log file to the log ring. The data is
+// read back from the page cache right into the ring.
+void appendLogRing(
+    LogRing& ring,
+    uint32_t stream,
+    int fd,
+    loff_t offset,
+    size_t len) {
+  LogRingHeader* header = ring.header;
+  while (len > 0) {
+    const uint32_t chunk = std::min(len, kLogRecordMaxLength);
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    const uint64_t recordSize = getLogRecordSize(chunk);
+    const uint64_t room = header->size - head % header->size;
+    if (room < recordSize) {
+      // Pad to the end of the data area and start over at the front.
+      claimLogRingSpace(ring, head, head + room);
+      LogRecord* pad = reinterpret_cast<LogRecord*>(
+          ring.data + head % header->size);
+      *pad = {static_cast<uint32_t>(room - sizeof(LogRecord)),
+              kLogRecordPadding,
+              0};
+      head += room;
+      header->head.store(head, std::memory_order_release);
+    }
+    claimLogRingSpace(ring, head, head + recordSize);
+    LogRecord* record =
+        reinterpret_cast<LogRecord*>(ring.data + head % header->size);
+    ssize_t n = pread(fd, record + 1, chunk, offset);
+    if (n <= 0) {
+      return;
+    }
+    *record = {static_cast<uint32_t>(n), stream, ring.nextSeq++};
+    header->head.store(
+        head + getLogRecordSize(n), std::memory_order_release);
+    offset += n;
+    len -= n;
+  }
+}
+
+// A log file that one output stream of the container is spliced into.
+struct LogStream {
+  // 1 for stdout and 2 for stderr.
+  uint32_t index;
+  // Read end of the pipe the container writes the stream to.
+  int pipefd;
+  std::string path;
+  int fd;
+  // The file isn't opened with O_APPEND, which splice() doesn't support, so
+  // the agent keeps track of the end.
+  loff_t offset;
+};
+
+// Called in parent (agent) process.
+// Opens the log file of a stream, continuing an existing one.
+void openLogFile(LogStream& stream) {
+  // Readable, to copy the output into the log ring from the page cache.
+  stream.fd =
+      open(stream.path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+  if (stream.fd == -1) {
+    errExit("open(log file)");
+  }
+  stream.offset = lseek(stream.fd, 0, SEEK_END);
+}
+
+// Called in parent (agent) process.
+// Renames FILE to FILE.1, FILE.1 to FILE.2 and so on, dropping the oldest,
+// and starts a new FILE.
+void rotateLogFile(LogStream& stream, const LogOptions& options) {
+  close(stream.fd);
+  // rename() replaces the oldest file.
+  for (int i = options.maxFiles; i > 0; --i) {
+    const std::string from =
+        i == 1 ? stream.path : stream.path + "." + std::to_string(i - 1);
+    rename(from.c_str(), (stream.path + "." + std::to_string(i)).c_str());
+  }
+  if (options.maxFiles == 0) {
+    unlink(stream.path.c_str());
+  }
+  openLogFile(stream);
+}
+
+// Called in parent (agent) process.
+// Tees what is buffered in the pipe of a stream into the tail pipe, whose
+// oldest data is dropped to make room. Returns how much to move into the log
+// file, so that the tail doesn't miss any of it.
+size_t teeLogTail(
+    LogStream& stream,
+    const LogOptions& options,
+    int tailfd[2]) {
+  size_t len = kLogChunkSize;
+  if (tailfd[1] == -1) {
+    return len;
+  }
+  ssize_t teed;
+  while ((teed = tee(stream.pipefd, tailfd[1], len, SPLICE_F_NONBLOCK)) ==
+             -1 &&
+         errno == EAGAIN) {
+    int queued = 0;
+    ioctl(stream.pipefd, FIONREAD, &queued);
+    if (queued == 0) {
+      // Nothing to tee. Let splice() tell an empty pipe from the end.
+      break;
+    }
+    // The tail pipe is full.
+    if (splice(
+          tailfd[0],
+          nullptr,
+          options.devNullFd,
+          nullptr,
+          kLogTailDropSize,
+          SPLICE_F_NONBLOCK) == -1) {
+      break;
+    }
+  }
+  return teed > 0 ? teed : len;
+}
+
+// Called in parent (agent) process.
+// Accounts for n bytes that were moved into the log file of a stream, ending
+// at stream.offset: copies them into the log ring and rotates the file when
+// it's full. Returns true if it rotated the file.
+bool commitLogs(
+    LogStream& stream,
+    const LogOptions& options,
+    LogRing& ring,
+    size_t n) {
+  if (ring.header != nullptr) {
+    appendLogRing(ring, stream.index, stream.fd, stream.offset - n, n);
+  }
+  if (options.maxSize > 0 && stream.offset >= options.maxSize) {
+    rotateLogFile(stream, options);
+    return true;
+  }
+  return false;
+}
+
+// Called in parent (agent) process.
+// Moves everything that is buffered in the pipe of a stream into its log file,
+// without copying it to user space. Returns false at the end of the stream.
+bool spliceLogs(
+    LogStream& stream,
+    const LogOptions& options,
+    int tailfd[2],
+    LogRing& ring) {
+  for (;;) {
+    const size_t len = teeLogTail(stream, options, tailfd);
+    ssize_t n = splice(
+        stream.pipefd,
+        nullptr,
+        stream.fd,
+        &stream.offset,
+        len,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) {
+      return false;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        perror("[Agent] splice(log)");
+      }
+      return errno == EAGAIN;
+    }
+    commitLogs(stream, options, ring, n);
+  }
+}
+
+// Called in parent (agent) process.
+// The relay loop on epoll, where io_uring isn't available.
+void relayLogsEpoll(
+    std::vector<LogStream>& streams,
+    int pidfd,
+    const LogOptions& options,
+    int tailfd[2],
+    LogRing& ring) {
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    errExit("epoll_create1");
+  }
+  for (size_t i = 0; i <= streams.size(); ++i) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    const int fd = i < streams.size() ? streams[i].pipefd : pidfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      errExit("epoll_ctl(log pipe)");
+    }
+  }
+
+  size_t openStreams = streams.size();
+  bool exited = false;
+  while (openStreams > 0 && !exited) {
+    struct epoll_event events[4];
+    int n = epoll_wait(epfd, events, 4, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      errExit("epoll_wait");
+    }
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.u64 == streams.size()) {
+        exited = true;
+        continue;
+      }
+      LogStream& stream = streams[events[i].data.u64];
+      if (stream.pipefd != -1 &&
+          !spliceLogs(stream, options, tailfd, ring)) {
+        close(stream.pipefd);
+        stream.pipefd = -1;
+        --openStreams;
+      }
+    }
+  }
+  close(epfd);
+}
+
+// Called in parent (agent) process.
+// The relay loop on io_uring. Every iteration takes one io_uring_enter() for
+// all streams: it submits the splices of the streams that became readable,
+// each linked to the poll that waits for its next output, and waits for the
+// next completions. The pipes and log files are registered files, slots
+// [0, n) for the log files, [n, 2n) for the pipes and 2n for the pidfd.
+void relayLogsIoUring(
+    std::vector<LogStream>& streams,
+    int pidfd,
+    const LogOptions& options,
+    int tailfd[2],
+    LogRing& ring,
+    IoUring& uring) {
+  enum { kPoll, kSplice, kExit };
+  const unsigned n = streams.size();
+  auto queuePoll = [&uring, n](unsigned i) {
+    struct io_uring_sqe* sqe = getIoUringSqe(uring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = n + i;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = i << 8 | kPoll;
+  };
+  for (unsigned i = 0; i < n; ++i) {
+    registerIoUringFile(uring, i, streams[i].fd);
+    registerIoUringFile(uring, n + i, streams[i].pipefd);
+    queuePoll(i);
+  }
+  registerIoUringFile(uring, 2 * n, pidfd);
+  struct io_uring_sqe* sqe = getIoUringSqe(uring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = 2 * n;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = kExit;
+
+  size_t openStreams = n;
+  size_t splicing = 0;
+  bool exited = false;
+  // Splices that are in flight finish before the streams are drained.
+  while ((openStreams > 0 && !exited) || splicing > 0) {
+    submitIoUring(uring, 1);
+    struct io_uring_cqe cqe;
+    while (nextIoUringCqe(uring, cqe)) {
+      const unsigned i = cqe.user_data >> 8;
+      LogStream* stream = i < n ? &streams[i] : nullptr;
+      switch (cqe.user_data & 0xff) {
+        case kExit:
+          exited = true;
+          break;
+        case kPoll:
+          if (stream->pipefd == -1 || exited) {
+            break;
+          }
+          if (cqe.res == -ECANCELED) {
+            // The linked splice failed, e.g. with EAGAIN.
+            queuePoll(i);
+            break;
+          }
+          // The tail is teed synchronously, so that the splice moves what
+          // was teed.
+          sqe = getIoUringSqe(uring);
+          sqe->opcode = IORING_OP_SPLICE;
+          sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+          sqe->fd = i;
+          sqe->off = stream->offset;
+          sqe->splice_fd_in = n + i;
+          sqe->splice_off_in = -1;
+          sqe->len = teeLogTail(*stream, options, tailfd);
+          sqe->splice_flags =
+              SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+          sqe->user_data = i << 8 | kSplice;
+          queuePoll(i);
+          ++splicing;
+          break;
+        case kSplice:
+          --splicing;
+          if (cqe.res > 0) {
+            stream->offset += cqe.res;
+            if (commitLogs(*stream, options, ring, cqe.res)) {
+              registerIoUringFile(uring, i, stream->fd);
+            }
+          } else if (cqe.res == 0 ||
+                     (cqe.res != -EAGAIN && cqe.res != -EINTR)) {
+            if (cqe.res < 0) {
+              errno = -cqe.res;
+              perror("[Agent] splice(log)");
+            }
+            // The pipe stays registered until the ring is closed.
+            close(stream->pipefd);
+            stream->pipefd = -1;
+            --openStreams;
+          }
+          break;
+      }
+    }
+  }
+}
+
+// Called in parent (agent) process, on its own thread.
+// Relays the stdout and stderr pipes of the container into its log files
+// until both are closed or the container exits. Returns the fd of the tail
+// pipe holding the last output, or -1.
+int relayLogs(
+    int cpid,
+    const std::vector<std::pair<int, std::string>>& pipes,
+    const LogOptions& options,
+    const std::string& ringPath) {
+  LogRing ring;
+  if (options.ringSize > 0) {
+    createLogRing(ringPath, options.ringSize, ring);
+  }
+  int tailfd[2] = {-1, -1};
+  if (options.tailSize > 0) {
+    if (pipe2(tailfd, O_CLOEXEC | O_NONBLOCK) == -1) {
+      errExit("pipe2(tail)");
+    }
+    fcntl(tailfd[1], F_SETPIPE_SZ, options.tailSize);
+  }
+  std::vector<LogStream> streams(pipes.size());
+  for (size_t i = 0; i < pipes.size(); ++i) {
+    streams[i].index = i + 1;
+    streams[i].pipefd = pipes[i].first;
+    streams[i].path = pipes[i].second;
+    openLogFile(streams[i]);
+  }
+  // Processes that escaped the container may keep the pipes open, so the
+  // relay also stops when the container exits.
+  int pidfd = syscall(SYS_pidfd_open, cpid, 0);
+  if (pidfd == -1) {
+    errExit("pidfd_open");
+  }
+  IoUring uring;
+  if (setupIoUring(kLogUringEntries, 2 * streams.size() + 1, uring)) {
+    relayLogsIoUring(streams, pidfd, options, tailfd, ring, uring);
+    closeIoUring(uring);
+  } else {
+    relayLogsEpoll(streams, pidfd, options, tailfd, ring);
+  }
+
+  // Whatever the container wrote before it exited is still buffered.
+  for (auto& stream : streams) {
+    if (stream.pipefd != -1) {
+      spliceLogs(stream, options, tailfd, ring);
+      close(stream.pipefd);
+    }
+    close(stream.fd);
+  }
+  close(pidfd);
+  if (ring.header != nullptr) {
+    ring.header->closed.store(1, std::memory_order_release);
+    munmap(ring.header, kLogRingDataOffset + ring.header->size);
+  }
+  if (tailfd[1] != -1) {
+    close(tailfd[1]);
+  }
+  return tailfd[0];
+}
+
+// Called in parent (agent) process.
+// Prints the last output of the container, e.g. when it failed.
+void printLogTail(int tailfd) {
+  char buf[4096];
+  ssize_t n;
+  std::cerr << "[Agent] Last output of the container:" << std::endl;
+  while ((n = read(tailfd, buf, sizeof(buf))) > 0) {
+    std::cerr.write(buf, n);
+  }
+  std::cerr << std::flush;
+}
+
+// Called in parent (agent) process.
+// Allocates a pseudo terminal for the container. Returns the master fd, and
+// the slave fd in slavefd.
+int openPty(int& slavefd) {
+  int masterfd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (masterfd == -1 || grantpt(masterfd) == -1 || unlockpt(masterfd) == -1) {
+    errExit("posix_openpt");
+  }
+  char name[64];
+  if (ptsname_r(masterfd, name, sizeof(name)) != 0) {
+    errExit("ptsname_r");
+  }
+  slavefd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (slavefd == -1) {
+    errExit("open(pty slave)");
+  }
+  return masterfd;
+}
+
+// Puts a terminal into raw mode, so that keys like Ctrl-C reach the
+// container, and saves its settings. Returns false if fd isn't a terminal.
+bool makeRawTerminal(int fd, struct termios& saved) {
+  if (tcgetattr(fd, &saved) == -1) {
+    return false;
+  }
+  struct termios raw = saved;
+  cfmakeraw(&raw);
+  return tcsetattr(fd, TCSADRAIN, &raw) == 0;
+}
+
+// Gives the pty the size of the terminal it is shown on. The kernel sends
+// SIGWINCH to the foreground process group of the pty if it changed.
+void copyWindowSize(int fromfd, int masterfd) {
+  struct winsize size;
+  if (ioctl(fromfd, TIOCGWINSZ, &size) == 0) {
+    ioctl(masterfd, TIOCSWINSZ, &size);
+  }
+}
+
+// A terminal attached to the pty of a container: the agent's own or one
+// passed in by "mini_container attach".
+struct TtySession {
+  int infd;
+  int outfd;
+  // Connection of an attach client, or -1 for the agent's own terminal.
+  int sockfd;
+  // Settings to restore on detach, if the terminal was put into raw mode.
+  bool raw;
+  struct termios saved;
+  // Whether the last input byte was the first key of the detach sequence.
+  bool detachPending;
+  // Whether piped input ended.
+  bool inputEof;
+  TtySession() : infd(-1), outfd(-1), sockfd(-1), raw(false),
+                 detachPending(false), inputEof(false) {}
+};
+
+// Called in parent (agent) process.
+// Moves the output of the container from the pty master to the attached
+// terminal. The data is spliced through a pipe without copying it to user
+// space, unless one of the ends doesn't support splice(). Without a terminal,
+// the output is discarded so the container doesn't block. Returns false once
+// the pty is closed.
+bool relayTtyOutput(int masterfd, int outfd, int pipefd[2]) {
+  char buf[kTtyChunkSize];
+  ssize_t n = -1;
+  if (pipefd[0] != -1) {
+    n = splice(
+        masterfd, nullptr, pipefd[1], nullptr, kTtyChunkSize,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1 && errno == EINVAL) {
+      close(pipefd[0]);
+      close(pipefd[1]);
+      pipefd[0] = pipefd[1] = -1;
+    }
+  }
+  if (pipefd[0] == -1) {
+    n = read(masterfd, buf, sizeof(buf));
+  }
+  if (n <= 0) {
+    // EIO once all slave fds are closed.
+    return n == -1 && (errno == EAGAIN || errno == EINTR);
+  }
+  while (n > 0) {
+    ssize_t written;
+    if (pipefd[0] != -1) {
+      written = outfd == -1 ? -1 : splice(
+          pipefd[0], nullptr, outfd, nullptr, n, SPLICE_F_MOVE);
+      if (written == -1) {
+        // Drain the pipe so it doesn't fill up.
+        written = read(pipefd[0], buf, std::min<size_t>(n, sizeof(buf)));
+        if (written <= 0) {
+          break;
+        }
+        if (outfd != -1 && write(outfd, buf, written) == -1) {
+          // The terminal went away, the rest is discarded.
+          outfd = -1;
+        }
+      }
+    } else {
+      written = outfd == -1 ? n : write(outfd, buf, n);
+      if (written == -1) {
+        break;
+      }
+    }
+    n -= written;
+  }
+  return true;
+}
+
+// Called in parent (agent) process.
+// Reads input from the attached terminal into the input pending for the pty
+// master, filtering out the detach sequence. Returns false if the session
+// should be detached.
+bool relayTtyInput(TtySession& session, std::string& pending) {
+  char buf[kTtyChunkSize];
+  ssize_t n = read(session.infd, buf, sizeof(buf));
+  if (n == -1) {
+    return errno == EAGAIN || errno == EINTR;
+  }
+  if (n == 0) {
+    // Piped input ended. Pass on the end of file to the container.
+    session.inputEof = true;
+    pending += '\x04';  // Ctrl-D
+    return true;
+  }
+  for (ssize_t i = 0; i < n; ++i) {
+    if (session.detachPending) {
+      session.detachPending = false;
+      if (buf[i] == kDetachKeys[1]) {
+        return false;
+      }
+      pending += kDetachKeys[0];
+    }
+    if (buf[i] == kDetachKeys[0]) {
+      session.detachPending = true;
+    } else {
+      pending += buf[i];
+    }
+  }
+  return true;
+}
+
+// Called in parent (agent) process.
+// Writes as much of the pending input to the pty master as it takes without
+// blocking. Once the pty is gone, the input is dropped.
+void writeTtyInput(int masterfd, std::string& pending) {
+  while (!pending.empty()) {
+    ssize_t written = write(masterfd, pending.data(), pending.size());
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        pending.clear();
+      }
+      return;
+    }
+    pending.erase(0, written);
+  }
+}
+
+void detachTtySession(TtySession& session, int epfd) {
+  if (session.infd == -1) {
+    return;
+  }
+  epoll_ctl(epfd, EPOLL_CTL_DEL, session.infd, nullptr);
+  if (session.raw) {
+    tcsetattr(session.infd, TCSADRAIN, &session.saved);
+  }
+  if (session.sockfd != -1) {
+    // Tells the attach client that it is detached.
+    epoll_ctl(epfd, EPOLL_CTL_DEL, session.sockfd, nullptr);
+    close(session.sockfd);
+    close(session.infd);
+    close(session.outfd);
+  }
+  session = TtySession();
+}
+
+// Called in parent (agent) process, on its own thread.
+// Relays between the pty of the container and the attached terminal until
+// the container exits, all in one epoll loop. The agent's own terminal is
+// attached first. Clients of "mini_container attach" connect to listenfd and
+// replace the attached terminal. The detach keys detach the terminal while
+// the container keeps running.
+void relayTty(int cpid, int masterfd, int listenfd) {
+  enum { kMaster, kInput, kClient, kListen, kSignal, kPid };
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    errExit("epoll_create1");
+  }
+  auto watch = [epfd](int fd, uint64_t tag) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      errExit("epoll_ctl(tty)");
+    }
+  };
+  // SIGWINCH is blocked in all agent threads by main().
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  int pidfd = syscall(SYS_pidfd_open, cpid, 0);
+  if (sigfd == -1 || pidfd == -1) {
+    errExit("signalfd");
+  }
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) == -1) {
+    errExit("pipe2(tty)");
+  }
+  fcntl(masterfd, F_SETFL, O_NONBLOCK);
+  watch(masterfd, kMaster);
+  watch(sigfd, kSignal);
+  watch(pidfd, kPid);
+  if (listenfd != -1) {
+    watch(listenfd, kListen);
+  }
+
+  // Input that the pty master didn't take yet. While there is any, the
+  // master is watched for room instead of the terminal for more input, so
+  // that a paste or piped input waits instead of being dropped.
+  TtySession session;
+  std::string pendingInput;
+  bool inputPaused = false;
+  auto watchInput = [&]() {
+    if (!inputPaused && !session.inputEof) {
+      watch(session.infd, kInput);
+    }
+  };
+  auto flushInput = [&]() {
+    writeTtyInput(masterfd, pendingInput);
+    const bool pause = !pendingInput.empty();
+    if (pause == inputPaused) {
+      return;
+    }
+    inputPaused = pause;
+    struct epoll_event event = {};
+    event.events = pause ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.u64 = kMaster;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, masterfd, &event) == -1) {
+      errExit("epoll_ctl(tty)");
+    }
+    if (session.infd == -1) {
+      return;
+    }
+    if (!pause) {
+      watchInput();
+    } else if (!session.inputEof) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, session.infd, nullptr);
+    }
+  };
+  // The agent's terminal gets the tty back when an attach client goes away,
+  // unless it was detached itself.
+  bool agentDetached = false;
+  auto attachAgent = [&]() {
+    session.infd = STDIN_FILENO;
+    session.outfd = STDOUT_FILENO;
+    session.raw = makeRawTerminal(STDIN_FILENO, session.saved);
+    copyWindowSize(STDIN_FILENO, masterfd);
+    watchInput();
+  };
+  attachAgent();
+
+  bool running = true;
+  while (running) {
+    struct epoll_event events[8];
+    int n = epoll_wait(epfd, events, 8, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      errExit("epoll_wait(tty)");
+    }
+    for (int i = 0; i < n && running; ++i) {
+      switch (events[i].data.u64) {
+        case kMaster:
+          if (events[i].events & EPOLLOUT) {
+            flushInput();
+          }
+          if (events[i].events & ~EPOLLOUT) {
+            running = relayTtyOutput(masterfd, session.outfd, pipefd);
+          }
+          break;
+        case kInput:
+          if (!relayTtyInput(session, pendingInput)) {
+            agentDetached = agentDetached || session.sockfd == -1;
+            detachTtySession(session, epfd);
+            if (!agentDetached) {
+              attachAgent();
+            }
+          } else if (session.inputEof) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, session.infd, nullptr);
+          }
+          flushInput();
+          break;
+        case kClient: {
+          // The client writes a byte when its window size changes and
+          // closes the connection when it goes away.
+          char c;
+          if (read(session.sockfd, &c, 1) == 1) {
+            copyWindowSize(session.outfd, masterfd);
+          } else {
+            detachTtySession(session, epfd);
+            if (!agentDetached) {
+              attachAgent();
+            }
+          }
+          break;
+        }
+        case kListen: {
+          int clientfd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+          int fds[2];
+          if (clientfd == -1) {
+            break;
+          }
+          if (!receiveFds(clientfd, fds, 2)) {
+            close(clientfd);
+            break;
+          }
+          detachTtySession(session, epfd);
+          session.infd = fds[0];
+          session.outfd = fds[1];
+          session.sockfd = clientfd;
+          copyWindowSize(session.outfd, masterfd);
+          watchInput();
+          watch(session.sockfd, kClient);
+          break;
+        }
+        case kSignal: {
+          struct signalfd_siginfo info;
+          if (read(sigfd, &info, sizeof(info)) == sizeof(info) &&
+              session.sockfd == -1 && session.infd != -1) {
+            copyWindowSize(session.infd, masterfd);
+          }
+          break;
+        }
+        case kPid:
+          // Print what the container wrote before it exited.
+          while (relayTtyOutput(masterfd, session.outfd, pipefd)) {
+            int queued = 0;
+            if (ioctl(masterfd, FIONREAD, &queued) == -1 || queued == 0) {
+              break;
+            }
+          }
+          running = false;
+          break;
+      }
+    }
+  }
+  detachTtySession(session, epfd);
+  for (int fd : {epfd, sigfd, pidfd, pipefd[0], pipefd[1], masterfd}) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  if (listenfd != -1) {
+    close(listenfd);
+  }
+}
+
+// Called in parent (agent) process.
+// Creates the socket that "mini_container attach" connects to.
+int listenForAttach(const std::string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (fd == -1 || path.size() >= sizeof(addr.sun_path)) {
+    errExit("socket(attach)");
+  }
+  strcpy(addr.sun_path, path.c_str());
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ==
+          -1 ||
+      listen(fd, 4) == -1) {
+    errExit("bind(attach)");
+  }
+  return fd;
+}
+
+void waitForAgent(int pipefd[2]) {
+  // Close unused write end of the pipe
+  if (close(pipefd[1]) == -1) {
+    errExit("[Container] close(pipefd[1])");
+  }
+  int ret = 0;
+  bool success = false;
+  // Wait until agent writes to the pipe
+  do {
+    ret = read(pipefd[0], &success, sizeof(success));
+  } while (ret == -1 && errno == EINTR);
+  if (ret != sizeof(success) || !success) {
+    errExit("[Container] Preparation failed");
+  }
+
+  // Read end of the pipe is no longer needed. Close it.
+  if (close(pipefd[0]) == -1) {
+    errExit("[Container] close(pipefd[0])");
+  }
+}
+
+// The parts of an ELF file needed to find its shared library dependencies.
+struct ElfInfo {
+  unsigned char elfClass;
+  uint16_t machine;
+  std::string interpreter;
+  std::vector<std::string> needed;
+  // Library search paths from DT_RPATH and DT_RUNPATH, with $ORIGIN expanded.
+  std::vector<std::string> rpath;
+  std::vector<std::string> runpath;
+  bool hasRunpath;
+  ElfInfo() : elfClass(ELFCLASSNONE), machine(EM_NONE), hasRunpath(false) {}
+};
+
+std::vector<std::string> splitSearchPath(
+    const std::string& paths,
+    const std::string& origin) {
+  std::vector<std::string> dirs;
+  std::istringstream iss(paths);
+  std::string dir;
+  while (std::getline(iss, dir, ':')) {
+    for (const std::string var : {"$ORIGIN", "${ORIGIN}"}) {
+      size_t pos = dir.find(var);
+      if (pos != std::string::npos) {
+        dir.replace(pos, var.size(), origin);
+      }
+    }
+    if (!dir.empty()) {
+      dirs.push_back(dir);
+    }
+  }
+  return dirs;
+}
+
+// Reads the dynamic section of a 64-bit ELF file. Returns false if the file is
+// not one.
+bool readElf(const std::string& path, ElfInfo& info) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      static_cast<size_t>(st.st_size) < sizeof(Elf64_Ehdr)) {
+    close(fd);
+    return false;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  const size_t size = st.st_size;
+  const char* data = static_cast<const char*>(addr);
+  const auto* ehdr = reinterpret_cast<const Elf64_Ehdr*>(data);
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > size) {
+    munmap(addr, size);
+    return false;
+  }
+  info.elfClass = ehdr->e_ident[EI_CLASS];
+  info.machine = ehdr->e_machine;
+
+  const auto* phdrs = reinterpret_cast<const Elf64_Phdr*>(data + ehdr->e_phoff);
+  // Converts a virtual address to a file offset using the loadable segments.
+  auto toOffset = [&](Elf64_Addr vaddr) -> size_t {
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+      if (phdrs[i].p_type == PT_LOAD && vaddr >= phdrs[i].p_vaddr &&
+          vaddr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+        return vaddr - phdrs[i].p_vaddr + phdrs[i].p_offset;
+      }
+    }
+    return size;
+  };
+
+  const Elf64_Dyn* dyns = nullptr;
+  size_t dynCount = 0;
+  for (int i = 0; i < ehdr->e_phnum; ++i) {
+    const Elf64_Phdr& phdr = phdrs[i];
+    if (phdr.p_offset + phdr.p_filesz > size) {
+      continue;
+    }
+    if (phdr.p_type == PT_INTERP) {
+      info.interpreter = std::string(
+          data + phdr.p_offset, strnlen(data + phdr.p_offset, phdr.p_filesz));
+    } else if (phdr.p_type == PT_DYNAMIC) {
+      dyns = reinterpret_cast<const Elf64_Dyn*>(data + phdr.p_offset);
+      dynCount = phdr.p_filesz / sizeof(Elf64_Dyn);
+    }
+  }
+
+  size_t strtab = size;
+  for (size_t i = 0; i < dynCount && dyns[i].d_tag != DT_NULL; ++i) {
+    if (dyns[i].d_tag == DT_STRTAB) {
+      strtab = toOffset(dyns[i].d_un.d_ptr);
+    }
+  }
+  const std::string origin = path.substr(0, path.rfind('/'));
+  for (size_t i = 0; strtab < size && i < dynCount && dyns[i].d_tag != DT_NULL;
+       ++i) {
+    const size_t offset = strtab + dyns[i].d_un.d_val;
+    if (offset >= size) {
+      continue;
+    }
+    const std::string value(
+        data + offset, strnlen(data + offset, size - offset));
+    if (dyns[i].d_tag == DT_NEEDED) {
+      info.needed.push_back(value);
+    } else if (dyns[i].d_tag == DT_RPATH) {
+      info.rpath = splitSearchPath(value, origin);
+    } else if (dyns[i].d_tag == DT_RUNPATH) {
+      info.runpath = splitSearchPath(value, origin);
+      info.hasRunpath = true;
+    }
+  }
+  munmap(addr, size);
+  return true;
+}
+
+// Reads the library directories from ld.so.conf, following include lines.
+void readLdSoConf(const std::string& file, std::vector<std::string>& dirs) {
+  std::ifstream ifs(file);
+  std::string line;
+  while (std::getline(ifs, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream iss(line);
+    std::string word;
+    if (!(iss >> word)) {
+      continue;
+    }
+    if (word != "include") {
+      dirs.push_back(word);
+      continue;
+    }
+    std::string pattern;
+    while (iss >> pattern) {
+      glob_t globbuf;
+      if (glob(pattern.c_str(), 0, nullptr, &globbuf) == 0) {
+        for (size_t i = 0; i < globbuf.gl_pathc; ++i) {
+          readLdSoConf(globbuf.gl_pathv[i], dirs);
+        }
+      }
+      globfree(&globbuf);
+    }
+  }
+}
+
+// Finds a library the way the dynamic loader would: in DT_RPATH of the object
+// and the executable unless the object has DT_RUNPATH, then in DT_RUNPATH, the
+// ld.so.conf directories and the default directories. The executable is the
+// one whose process loads the object. Only libraries matching its class and
+// machine are considered.
+std::string findLibrary(
+    const std::string& name,
+    const ElfInfo& object,
+    const ElfInfo& executable,
+    const std::vector<std::string>& systemDirs) {
+  std::vector<std::string> dirs;
+  if (name.find('/') != std::string::npos) {
+    dirs.push_back("");
+  } else {
+    if (!object.hasRunpath) {
+      dirs.insert(dirs.end(), object.rpath.begin(), object.rpath.end());
+      dirs.insert(
+          dirs.end(), executable.rpath.begin(), executable.rpath.end());
+    }
+    dirs.insert(dirs.end(), object.runpath.begin(), object.runpath.end());
+    dirs.insert(dirs.end(), systemDirs.begin(), systemDirs.end());
+  }
+  for (const auto& dir : dirs) {
+    const std::string path = dir.empty() ? name : dir + "/" + name;
+    ElfInfo info;
+    if (readElf(path, info) && info.elfClass == executable.elfClass &&
+        info.machine == executable.machine) {
+      return path;
+    }
+  }
+  return "";
+}
+
+// Finds an executable in PATH unless the name is already a path.
+std::string findExecutable(const std::string& name) {
+  if (name.find('/') != std::string::npos) {
+    return name;
+  }
+  const char* path = getenv("PATH");
+  std::istringstream iss(path ? path : "/usr/local/bin:/usr/bin:/bin");
+  std::string dir;
+  while (std::getline(iss, dir, ':')) {
+    const std::string candidate = dir + "/" + name;
+    if (access(candidate.c_str(), X_OK) == 0) {
+      return candidate;
+    }
+  }
+  return "";
+}
+
+// Splits a command line into words the way the shell would, with quotes,
+// escapes and variables but without command substitution. Returns false if it
+// is empty or can't be parsed.
+bool splitCommandLine(const std::string& cmd, std::vector<std::string>& args) {
+  wordexp_t words;
+  if (wordexp(cmd.c_str(), &words, WRDE_NOCMD) != 0) {
+    return false;
+  }
+  args.assign(words.we_wordv, words.we_wordv + words.we_wordc);
+  wordfree(&words);
+  return !args.empty();
+}
+
+// Runs a probe command on the host with the dynamic loader's debug output
+// enabled, and returns the libraries it loaded, including the ones opened
+// with dlopen(), as (name, path of the object that loaded it) pairs.
+std::vector<std::pair<std::string, std::string>> probeLibraries(
+    const std::vector<std::string>& cmd) {
+  char dir[] = "/tmp/mini_container.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    errExit("mkdtemp");
+  }
+  const std::string prefix = std::string(dir) + "/ld";
+
+  std::vector<char*> args;
+  for (const auto& arg : cmd) {
+    args.push_back(const_cast<char*>(arg.c_str()));
+  }
+  args.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    errExit("fork");
+  }
+  if (pid == 0) {
+    // The loader writes the debug output to <prefix>.<pid>.
+    setenv("LD_DEBUG", "files", 1);
+    setenv("LD_DEBUG_OUTPUT", prefix.c_str(), 1);
+    execvp(args[0], args.data());
+    errExit("execvp(probe)");
+  }
+  if (waitpid(pid, nullptr, 0) == -1) {
+    errExit("waitpid(probe)");
+  }
+
+  // Lines look like "file=libfoo.so.1 [0];  needed by /usr/bin/foo [0]" or
+  // "file=libbar.so [0];  dynamically loaded by /usr/bin/foo [0]".
+  std::vector<std::pair<std::string, std::string>> libraries;
+  glob_t globbuf;
+  const std::string pattern = prefix + ".*";
+  if (glob(pattern.c_str(), 0, nullptr, &globbuf) == 0) {
+    for (size_t i = 0; i < globbuf.gl_pathc; ++i) {
+      std::ifstream ifs(globbuf.gl_pathv[i]);
+      std::string line;
+      while (std::getline(ifs, line)) {
+        size_t file = line.find("file=");
+        size_t by = line.find(" by ");
+        if (file == std::string::npos || by == std::string::npos) {
+          continue;
+        }
+        const std::string name =
+            line.substr(file + 5, line.find(' ', file) - file - 5);
+        const std::string loader =
+            line.substr(by + 4, line.find(' ', by + 4) - by - 4);
+        libraries.push_back({name, loader});
+      }
+      unlink(globbuf.gl_pathv[i]);
+    }
+  }
+  globfree(&globbuf);
+  rmdir(dir);
+  return libraries;
+}
+
+// Places a host file at the same path under the new rootfs. The file is
+// reflinked if possible and copied otherwise, so that nothing written through
+// the rootfs reaches the host's file. With hardlink, it is hardlinked if
+// possible instead, so that the rootfs shares the page cache with the host.
+// Returns the number of bytes taken by a copy.
+off_t placeFile(
+    const std::string& hostPath,
+    const std::string& output,
+    bool hardlink) {
+  const std::string target = output + hostPath;
+  makeMountPoint(target.substr(0, target.rfind('/')), true);
+  char realPath[PATH_MAX];
+  if (realpath(hostPath.c_str(), realPath) == nullptr) {
+    errExit("realpath");
+  }
+  if (hardlink &&
+      linkat(AT_FDCWD, realPath, AT_FDCWD, target.c_str(), 0) == 0) {
+    return 0;
+  }
+  if (access(target.c_str(), F_OK) == 0) {
+    return 0;
+  }
+
+  int src = open(realPath, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (src == -1 || fstat(src, &st) == -1) {
+    errExit("open(library)");
+  }
+  int dst = open(
+      target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode);
+  if (dst == -1) {
+    errExit("open(target)");
+  }
+  off_t copied = 0;
+  if (ioctl(dst, FICLONE, src) == -1) {
+    while (copied < st.st_size) {
+      ssize_t n = copy_file_range(
+          src, nullptr, dst, nullptr, st.st_size - copied, 0);
+      if (n <= 0) {
+        errExit("copy_file_range");
+      }
+      copied += n;
+    }
+  }
+  close(src);
+  close(dst);
+  return copied;
+}
+
+// Builds a minimal rootfs that only contains the given executables and the
+// shared libraries they need.
+int buildRootfsMain(int argc, char** argv) {
+  std::string output;
+  std::vector<std::string> probes;
+  std::vector<std::string> binaries;
+  bool hardlink = false;
+
+  po::options_description options{"Options"};
+  options.add_options()
+    ("help,h", "Print help message")
+    ("verbose,v", po::bool_switch(&verbose)->default_value(false),
+     "List the files placed in the rootfs")
+    ("output,o", po::value<std::string>(&output),
+     "Directory to create the rootfs in")
+    ("probe", po::value<std::vector<std::string>>(&probes),
+     "Run a command on the host and also include the libraries it loads "
+     "with dlopen(). It is split into words like a shell command line")
+    ("hardlink", po::bool_switch(&hardlink),
+     "Hardlink the files to the host's instead of reflinking or copying "
+     "them, so that containers share their page cache with the host. A "
+     "container that writes to the rootfs writes to the host's files, so "
+     "only use it for a rootfs that is run with --overlay");
+
+  po::options_description hiddenOptions{"Hidden Options"};
+  hiddenOptions.add_options()(
+      "binary", po::value<std::vector<std::string>>(&binaries));
+  po::positional_options_description posOptions;
+  posOptions.add("binary", -1);
+  po::options_description cmdlineOptions;
+  cmdlineOptions.add(options).add(hiddenOptions);
+
+  po::variables_map vm;
+  try {
+    po::store(
+        po::command_line_parser(argc, argv)
+            .options(cmdlineOptions)
+            .positional(posOptions)
+            .run(),
+        vm);
+    po::notify(vm);
+  } catch (const po::error& ex) {
+    std::cerr << ex.what() << std::endl;
+    return -1;
+  }
+  if (vm.count("help") || output.empty() || binaries.empty()) {
+    std::cout << "Usage: mini_container build-rootfs [options] BINARY..."
+              << std::endl
+              << std::endl;
+    std::cout << options << std::endl;
+    return 0;
+  }
+  if (output[0] != '/') {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+      errExit("getcwd");
+    }
+    output = std::string(cwd) + "/" + output;
+  }
+
+  // The default directories come after the ones in ld.so.conf.
+  std::vector<std::string> systemDirs;
+  readLdSoConf("/etc/ld.so.conf", systemDirs);
+  for (const std::string dir : {"/lib64", "/usr/lib64", "/lib", "/usr/lib"}) {
+    systemDirs.push_back(dir);
+  }
+
+  // Walk the dependency graph breadth first, starting from the executables
+  // and the objects found by the probes. An object is resolved once for each
+  // executable that loads it, since the executable's DT_RPATH, class and
+  // machine take part in the search.
+  std::set<std::string> files;
+  std::vector<ElfInfo> executables;
+  std::set<std::pair<std::string, size_t>> visited;
+  // (path, ELF info, index of the executable in executables)
+  std::queue<std::tuple<std::string, ElfInfo, size_t>> pending;
+  auto add = [&](const std::string& path, size_t executable) {
+    ElfInfo info;
+    files.insert(path);
+    if (visited.insert({path, executable}).second && readElf(path, info)) {
+      pending.push({path, info, executable});
+    }
+  };
+  // Reads an executable given by name or path into executables.
+  auto addExecutable = [&](const std::string& name, std::string& path) {
+    ElfInfo info;
+    path = findExecutable(name);
+    if (path.empty() || !readElf(path, info)) {
+      std::cerr << "Error: " << name << " is not a 64-bit ELF executable"
+                << std::endl;
+      return false;
+    }
+    executables.push_back(info);
+    return true;
+  };
+  for (const auto& binary : binaries) {
+    std::string path;
+    if (!addExecutable(binary, path)) {
+      return -1;
+    }
+    add(path, executables.size() - 1);
+  }
+  for (const auto& probe : probes) {
+    std::vector<std::string> args;
+    std::string path;
+    if (!splitCommandLine(probe, args)) {
+      std::cerr << "Error: Invalid probe command " << probe << std::endl;
+      return -1;
+    }
+    if (!addExecutable(args[0], path)) {
+      return -1;
+    }
+    const size_t executable = executables.size() - 1;
+    for (const auto& library : probeLibraries(args)) {
+      ElfInfo loader;
+      readElf(library.second, loader);
+      const std::string libraryPath = findLibrary(
+          library.first, loader, executables[executable], systemDirs);
+      if (!libraryPath.empty()) {
+        add(libraryPath, executable);
+      }
+    }
+  }
+  while (!pending.empty()) {
+    const auto [objectPath, object, executable] = pending.front();
+    pending.pop();
+    if (!object.interpreter.empty()) {
+      add(object.interpreter, executable);
+    }
+    for (const auto& name : object.needed) {
+      const std::string path =
+          findLibrary(name, object, executables[executable], systemDirs);
+      if (path.empty()) {
+        std::cerr << "Error: Can't find " << name << " needed by "
+                  << objectPath << std::endl;
+        return -1;
+      }
+      add(path, executable);
+    }
+  }
+
+  // Place the files and the directories the container needs.
+  off_t copied = 0;
+  std::set<std::string> libraryDirs;
+  for (const auto& file : files) {
+    if (verbose) {
+      std::cout << file << std::endl;
+    }
+    copied += placeFile(file, output, hardlink);
+    libraryDirs.insert(file.substr(0, file.rfind('/')));
+  }
+  for (const std::string dir : {"/proc", "/dev", "/etc", "/tmp"}) {
+    makeMountPoint(output + dir, true);
+  }
+  chmod((output + "/tmp").c_str(), 01777);
+
+  // Generate the loader cache so that libraries are found in directories
+  // which are not searched by default.
+  std::ofstream conf(output + "/etc/ld.so.conf");
+  for (const auto& dir : libraryDirs) {
+    conf << dir << "\n";
+  }
+  conf.close();
+  // The output path is passed as is, without a shell to interpret it.
+  pid_t pid = fork();
+  if (pid == -1) {
+    errExit("fork");
+  }
+  if (pid == 0) {
+    execlp("ldconfig", "ldconfig", "-r", output.c_str(), nullptr);
+    errExit("execlp(ldconfig)");
+  }
+  int status;
+  if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    std::cout << "Warning: generating ld.so.cache failed" << std::endl;
+  }
+
+  std::cout << "Built " << output << " with " << files.size() << " files ("
+            << copied << " bytes copied)" << std::endl;
+  return 0;
+}
+
+// A file found by the dedupe pass. Hardlinked paths share one entry.
+struct DedupeFile {
+  std::vector<std::string> paths;
+  struct stat st;
+  uint64_t hash;
+};
+
+std::vector<DedupeFile>* dedupeFiles = nullptr;
+std::map<std::pair<dev_t, ino_t>, size_t>* dedupeInodes = nullptr;
+
+// nftw() callback that collects the regular files of the rootfs trees.
+int collectDedupeFile(
+    const char* path,
+    const struct stat* st,
+    int typeflag,
+    struct FTW* /* ftwbuf */) {
+  if (typeflag != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) {
+    return 0;
+  }
+  auto inserted = dedupeInodes->insert(
+      {{st->st_dev, st->st_ino}, dedupeFiles->size()});
+  if (inserted.second) {
+    dedupeFiles->push_back({{path}, *st, 0});
+  } else {
+    (*dedupeFiles)[inserted.first->second].paths.push_back(path);
+  }
+  return 0;
+}
+
+// A fast non-cryptographic hash of a file's content. Files with equal hashes
+// are compared byte by byte before they are deduplicated.
+uint64_t hashFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+  if (fd == -1) {
+    return 0;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::vector<uint64_t> buf(1 << 17);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  ssize_t n;
+  while ((n = read(fd, buf.data(), buf.size() * sizeof(uint64_t))) > 0) {
+    // Zero the tail of a partial last word.
+    memset(reinterpret_cast<char*>(buf.data()) + n, 0, (8 - n % 8) % 8);
+    for (size_t i = 0; i < (static_cast<size_t>(n) + 7) / 8; ++i) {
+      hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+      hash ^= hash >> 29;
+    }
+  }
+  close(fd);
+  return hash;
+}
+
+bool sameContent(const std::string& a, const std::string& b) {
+  std::ifstream fa(a, std::ios::binary);
+  std::ifstream fb(b, std::ios::binary);
+  std::vector<char> bufa(1 << 20);
+  std::vector<char> bufb(1 << 20);
+  while (fa && fb) {
+    fa.read(bufa.data(), bufa.size());
+    fb.read(bufb.data(), bufb.size());
+    if (fa.gcount() != fb.gcount() ||
+        memcmp(bufa.data(), bufb.data(), fa.gcount()) != 0) {
+      return false;
+    }
+  }
+  return fa.eof() && fb.eof();
+}
+
+// Reads the extended attributes of a path, e.g. security.capability, without
+// following a symlink. Returns false if they can't be read.
+bool readXattrs(
+    const std::string& path,
+    std::map<std::string, std::string>& xattrs) {
+  std::vector<char> names;
+  for (;;) {
+    ssize_t size = llistxattr(path.c_str(), nullptr, 0);
+    if (size == -1) {
+      return errno == ENOTSUP;
+    }
+    names.resize(size);
+    size = llistxattr(path.c_str(), names.data(), names.size());
+    if (size != -1) {
+      names.resize(size);
+      break;
+    }
+    if (errno != ERANGE) {
+      return false;
+    }
+  }
+  for (size_t pos = 0; pos < names.size(); pos += strlen(&names[pos]) + 1) {
+    const char* name = &names[pos];
+    std::string value;
+    for (;;) {
+      ssize_t size = lgetxattr(path.c_str(), name, nullptr, 0);
+      if (size == -1) {
+        return false;
+      }
+      value.resize(size);
+      size = lgetxattr(path.c_str(), name, &value[0], value.size());
+      if (size != -1) {
+        value.resize(size);
+        break;
+      }
+      if (errno != ERANGE) {
+        return false;
+      }
+    }
+    xattrs[name] = value;
+  }
+  return true;
+}
+
+bool sameXattrs(const std::string& a, const std::string& b) {
+  std::map<std::string, std::string> xattrsa;
+  std::map<std::string, std::string> xattrsb;
+  return readXattrs(a, xattrsa) && readXattrs(b, xattrsb) &&
+      xattrsa == xattrsb;
+}
+
+// Atomically replaces a path with a hardlink to, or a reflink of, the
+// canonical copy. Processes that have the old file open or mapped keep using
+// it, and new ones get the canonical copy.
+bool replaceWithCanonical(
+    const std::string& path,
+    const DedupeFile& canonical,
+    const struct stat& st,
+    bool reflink) {
+  // The pid keeps the name apart from other runs, and anything left there by
+  // a run of the same pid that died before the rename is in the way.
+  const std::string tmp =
+      path + ".mini_container_dedupe." + std::to_string(getpid());
+  unlink(tmp.c_str());
+  if (reflink) {
+    // The reflink keeps the owner, mode, extended attributes and mtime of
+    // the file it replaces. The xattrs go after fchown(), which clears file
+    // capabilities.
+    std::map<std::string, std::string> xattrs;
+    int src = open(canonical.paths[0].c_str(), O_RDONLY | O_CLOEXEC);
+    int dst = open(
+        tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode);
+    bool ok = readXattrs(path, xattrs) && src != -1 && dst != -1 &&
+        ioctl(dst, FICLONE, src) == 0 &&
+        fchown(dst, st.st_uid, st.st_gid) == 0 &&
+        fchmod(dst, st.st_mode & 07777) == 0;
+    for (auto it = xattrs.begin(); ok && it != xattrs.end(); ++it) {
+      ok = fsetxattr(
+               dst, it->first.c_str(), it->second.data(), it->second.size(),
+               0) == 0;
+    }
+    const struct timespec times[2] = {st.st_atim, st.st_mtim};
+    ok = ok && futimens(dst, times) == 0;
+    if (src != -1) {
+      close(src);
+    }
+    if (dst != -1) {
+      close(dst);
+    }
+    if (!ok) {
+      unlink(tmp.c_str());
+      return false;
+    }
+  } else if (link(canonical.paths[0].c_str(), tmp.c_str()) == -1) {
+    return false;
+  }
+  // Don't replace a file that changed since it was compared.
+  struct stat now;
+  if (lstat(path.c_str(), &now) == -1 || now.st_ino != st.st_ino ||
+      now.st_size != st.st_size || now.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+      now.st_mtim.tv_nsec != st.st_mtim.tv_nsec ||
+      rename(tmp.c_str(), path.c_str()) == -1) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Replaces identical files across rootfs trees with hardlinks (or reflinks)
+// of a single copy, so that containers of different images share the page
+// cache of identical files.
+int dedupeMain(int argc, char** argv) {
+  bool reflink = false;
+  bool dryRun = false;
+  std::vector<std::string> trees;
+
+  po::options_description options{"Options"};
+  options.add_options()
+    ("help,h", "Print help message")
+    ("verbose,v", po::bool_switch(&verbose)->default_value(false),
+     "List the deduplicated files")
+    ("reflink", po::bool_switch(&reflink),
+     "Use reflinks instead of hardlinks. Reflinked files share disk blocks "
+     "but not page cache, but may differ in owner, mode and extended "
+     "attributes. Without it, a container that writes to a hardlinked file "
+     "changes it in every tree, so only run hardlinked trees with --overlay")
+    ("dry-run,n", po::bool_switch(&dryRun),
+     "Only report what would be deduplicated");
+
+  po::options_description hiddenOptions{"Hidden Options"};
+  hiddenOptions.add_options()(
+      "rootfs", po::value<std::vector<std::string>>(&trees));
+  po::positional_options_description posOptions;
+  posOptions.add("rootfs", -1);
+  po::options_description cmdlineOptions;
+  cmdlineOptions.add(options).add(hiddenOptions);
+
+  po::variables_map vm;
+  try {
+    po::store(
+        po::command_line_parser(argc, argv)
+            .options(cmdlineOptions)
+            .positional(posOptions)
+            .run(),
+        vm);
+    po::notify(vm);
+  } catch (const po::error& ex) {
+    std::cerr << ex.what() << std::endl;
+    return -1;
+  }
+  if (vm.count("help") || trees.empty()) {
+    std::cout << "Usage: mini_container dedupe [options] ROOTFS..."
+              << std::endl
+              << std::endl;
+    std::cout << options << std::endl;
+    return 0;
+  }
+
+  // (1) Collect the regular files of all trees.
+  std::vector<DedupeFile> files;
+  std::map<std::pair<dev_t, ino_t>, size_t> inodes;
+  dedupeFiles = &files;
+  dedupeInodes = &inodes;
+  for (const auto& tree : trees) {
+    if (nftw(tree.c_str(), collectDedupeFile, 64, FTW_PHYS | FTW_MOUNT) ==
+        -1) {
+      errExit("nftw(rootfs)");
+    }
+  }
+  dedupeFiles = nullptr;
+  dedupeInodes = nullptr;
+
+  // (2) Only files with the same size on the same filesystem can be
+  // duplicates, so only those are hashed.
+  std::map<std::pair<dev_t, off_t>, std::vector<size_t>> bySize;
+  for (size_t i = 0; i < files.size(); ++i) {
+    bySize[{files[i].st.st_dev, files[i].st.st_size}].push_back(i);
+  }
+  std::vector<size_t> candidates;
+  for (const auto& group : bySize) {
+    if (group.second.size() > 1) {
+      candidates.insert(
+          candidates.end(), group.second.begin(), group.second.end());
+    }
+  }
+
+  // (3) Hash the candidates in parallel.
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < candidates.size(); i = next++) {
+      DedupeFile& file = files[candidates[i]];
+      file.hash = hashFile(file.paths[0]);
+    }
+  };
+  const unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < workers; ++i) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // (4) Replace each file with the first earlier file of its group of equal
+  // hashes that it is identical to, or keep it as the copy that later ones
+  // are compared with. Hardlinks share the owner, mode and extended
+  // attributes, such as file capabilities, so those must match too. A
+  // reflink keeps those of the file it replaces.
+  std::map<std::tuple<dev_t, off_t, uint64_t>, std::vector<size_t>> byHash;
+  for (size_t i : candidates) {
+    byHash[{files[i].st.st_dev, files[i].st.st_size, files[i].hash}]
+        .push_back(i);
+  }
+  size_t replacedFiles = 0;
+  off_t reclaimedBytes = 0;
+  for (const auto& group : byHash) {
+    std::vector<size_t> canonicals;
+    for (size_t i : group.second) {
+      const DedupeFile& duplicate = files[i];
+      auto it = std::find_if(
+          canonicals.begin(),
+          canonicals.end(),
+          [&files, &duplicate, reflink](size_t c) {
+            const DedupeFile& canonical = files[c];
+            return (reflink || (duplicate.st.st_mode == canonical.st.st_mode &&
+                                duplicate.st.st_uid == canonical.st.st_uid &&
+                                duplicate.st.st_gid == canonical.st.st_gid &&
+                                sameXattrs(
+                                    canonical.paths[0],
+                                    duplicate.paths[0]))) &&
+                sameContent(canonical.paths[0], duplicate.paths[0]);
+          });
+      if (it == canonicals.end()) {
+        canonicals.push_back(i);
+        continue;
+      }
+      const DedupeFile& canonical = files[*it];
+      size_t replaced = 0;
+      for (const auto& path : duplicate.paths) {
+        if (verbose) {
+          std::cout << path << " -> " << canonical.paths[0] << std::endl;
+        }
+        if (dryRun ||
+            replaceWithCanonical(path, canonical, duplicate.st, reflink)) {
+          ++replaced;
+        }
+      }
+      replacedFiles += replaced;
+      // The space is only freed if no other path links to the file.
+      if (replaced == duplicate.st.st_nlink) {
+        reclaimedBytes += duplicate.st.st_blocks * 512;
+      }
+    }
+  }
+
+  std::cout << (dryRun ? "Would replace " : "Replaced ") << replacedFiles
+            << " of " << files.size() << " files, reclaiming "
+            << reclaimedBytes << " bytes" << std::endl;
+  return 0;
+}
+
+// Returns the pid in our PID namespace of the process a pidfd refers to.
+pid_t getPidfdPid(int pidfd) {
+  std::ifstream ifs("/proc/self/fdinfo/" + std::to_string(pidfd));
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.compare(0, 4, "Pid:") == 0) {
+      return std::stoi(line.substr(4));
+    }
   }
+  return -1;
 }
 
-// Called in child (container) process
-void setupNetwork(const std::string& ip) {
-  // (1) Bring up lo interface
-  std::string cmd = "ip link set dev lo up";
-  if (system(cmd.c_str()) != 0) {
-    errExit("bring up lo device failed");
+// Runs a command in a running container: enters all of its namespaces with a
+// single setns() call, matches its root directory and creates the command
+// directly in its cgroup.
+int execMain(int argc, char** argv) {
+  // The command may have options of its own, so only the options before the
+  // container ID are ours.
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-v" || arg == "--verbose") {
+      verbose = true;
+    } else if (arg == "--") {
+      ++i;
+      break;
+    } else {
+      i = argc;
+    }
+  }
+  if (argc - i < 2) {
+    std::cout << "Usage: mini_container exec [options] ID COMMAND [ARG]..."
+              << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << "  -v [ --verbose ]      Enable verbose logging" << std::endl;
+    return 0;
   }
+  const std::string id = argv[i];
+  char** cmd = argv + i + 1;
 
-  // (2) Add IP to eth0
-  cmd = "ip addr add " + ip + "/" + kDefaultBridgePrefixLen + " dev eth0";
-  if (system(cmd.c_str()) != 0) {
-    errExit("adding IP to eth0 failed");
+  // (1) Resolve the container.
+  int pidfd = openContainerPidfd(id);
+  pid_t pid = pidfd == -1 ? -1 : getPidfdPid(pidfd);
+  if (pid <= 0) {
+    std::cerr << "Error: No running container " << id << std::endl;
+    return -1;
   }
 
-  // (3) Bring up eth0 interface
-  cmd = "ip link set dev eth0 up";
-  if (system(cmd.c_str()) != 0) {
-    errExit("bring up eth0 failed");
+  // (2) Open the container's root and cgroup, and read its seccomp filter,
+  // while the host's are visible.
+  std::vector<struct sock_filter> seccompFilter;
+  if (!readSeccompState(id, seccompFilter)) {
+    std::cerr << "Error: Failed to read the seccomp filter of container "
+              << id << std::endl;
+    return -1;
+  }
+  const std::string procPath = "/proc/" + std::to_string(pid);
+  int rootfd =
+      open((procPath + "/root").c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (rootfd == -1) {
+    errExit("open(/proc/<pid>/root)");
   }
+  int cgroupfd = open(
+      getContainerCgroup(pid).c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
 
-  // (4) Set default gateway
-  cmd = "ip route add default via " + kDefaultBridgeIp;
-  if (system(cmd.c_str()) != 0) {
-    errExit("setting default gateway failed");
+  // (3) Enter the namespaces that differ from ours. A user namespace can't be
+  // re-entered, so joining our own one would fail.
+  const std::vector<std::pair<std::string, int>> namespaces = {
+      {"user", CLONE_NEWUSER},
+      {"mnt", CLONE_NEWNS},
+      {"net", CLONE_NEWNET},
+      {"ipc", CLONE_NEWIPC},
+      {"uts", CLONE_NEWUTS},
+      {"pid", CLONE_NEWPID},
+      {"cgroup", CLONE_NEWCGROUP}};
+  int flags = 0;
+  for (const auto& ns : namespaces) {
+    struct stat ours;
+    struct stat theirs;
+    if (stat(("/proc/self/ns/" + ns.first).c_str(), &ours) == -1 ||
+        stat((procPath + "/ns/" + ns.first).c_str(), &theirs) == -1) {
+      errExit("stat(/proc/<pid>/ns)");
+    }
+    if (ours.st_ino != theirs.st_ino || ours.st_dev != theirs.st_dev) {
+      flags |= ns.second;
+    }
+  }
+  // The user namespace is entered by the command, since the container's ids
+  // can't move it into the cgroup.
+  if ((flags & ~CLONE_NEWUSER) != 0 &&
+      setns(pidfd, flags & ~CLONE_NEWUSER) == -1) {
+    errExit("setns(pidfd)");
+  }
+  if (verbose) {
+    std::cout << "[Exec] Joined namespaces 0x" << std::hex << flags
+              << std::dec << " of container " << pid << std::endl;
   }
-}
 
+  // (4) Create the command in the container's PID namespace and cgroup at
+  // once. Fall back to fork() and moving it on kernels without clone3().
+  struct clone_args args = {};
+  args.exit_signal = SIGCHLD;
+  if (cgroupfd != -1) {
+    args.flags = CLONE_INTO_CGROUP;
+    args.cgroup = cgroupfd;
+  }
+  pid_t cpid = syscall(SYS_clone3, &args, sizeof(args));
+  if (cpid == -1 && errno == ENOSYS) {
+    cpid = fork();
+    if (cpid == 0 && cgroupfd != -1) {
+      int procsfd = openat(cgroupfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+      if (procsfd == -1 || write(procsfd, "0", 1) != 1) {
+        errExit("write(cgroup.procs)");
+      }
+      close(procsfd);
+    }
+  }
+  if (cpid == -1) {
+    errExit("clone3");
+  }
+  if (cpid == 0) {
+    // (5) Enter the user namespace and change root to the container's.
+    // setns() refuses to enter a user namespace once chrooted.
+    if (flags & CLONE_NEWUSER) {
+      if (setns(pidfd, CLONE_NEWUSER) == -1) {
+        errExit("setns(pidfd, CLONE_NEWUSER)");
+      }
+      becomeUserNsRoot();
+    }
+    if (fchdir(rootfd) == -1 || chroot(".") == -1 || chdir("/") == -1) {
+      errExit("chroot(container root)");
+    }
+    if (seccompFilter.empty()) {
+      execvp(cmd[0], cmd);
+      errExit("execvp failed");
+    }
+    // Held to the filter of the container, and so run with execveat() like
+    // its command.
+    Command command;
+    command.args.assign(cmd, argv + argc);
+    for (char** var = environ; *var != nullptr; ++var) {
+      command.env.push_back(*var);
+    }
+    command.fd = openExecutable(AT_FDCWD, command);
+    if (command.fd == -1) {
+      std::cerr << "Error: " << cmd[0] << " not found" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    for (auto& arg : command.args) {
+      command.argv.push_back(&arg[0]);
+    }
+    command.argv.push_back(nullptr);
+    for (auto& var : command.env) {
+      command.envp.push_back(&var[0]);
+    }
+    command.envp.push_back(nullptr);
+    command.seccompFilter = std::move(seccompFilter);
+    runContainer(command);
+  }
+  close(pidfd);
+  close(rootfd);
+  if (cgroupfd != -1) {
+    close(cgroupfd);
+  }
 
-bool writeToFile(const std::string& file, const std::string& data) {
-  std::ofstream ofs(file);
-  if (ofs.is_open()) {
-    ofs << data;
-    ofs.close();
-  } else {
-    std::cout << "Error: Failed to open " << file << std::endl;
-    return false;
+  // (6) Exit with the status of the command.
+  int status;
+  if (waitpid(cpid, &status, 0) == -1) {
+    errExit("waitpid");
   }
-  return true;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 }
 
-std::string getContainerCgroup(int cpid) {
-  return kCgroupRoot + std::to_string(cpid);
+// Releases the IP addresses, published ports and fast path entries of
+// containers whose agent died without releasing them. Agents also release the
+// addresses when the bridge network runs out of them.
+int gcMain(int argc, char** /* argv */) {
+  if (argc != 1) {
+    std::cout << "Usage: mini_container gc" << std::endl;
+    return 0;
+  }
+  Ipam ipam;
+  openIpam(ipam);
+  std::cout << "Released " << collectIps(ipam) << " IP addresses"
+            << std::endl;
+  std::cout << "Unpublished " << collectPorts(ipam) << " ports" << std::endl;
+  std::cout << "Removed " << collectFastPath(ipam)
+            << " addresses from the fast path" << std::endl;
+  return 0;
 }
 
-bool setupCgroup(int cpid, const ResourceLimit& limit) {
-  // (1) Create a cgroup at <root>/<cpid>
-  const std::string cgroupPath = getContainerCgroup(cpid);
-  if (mkdir(cgroupPath.c_str(), 0755) == -1) {
-    perror("mkdir(cgroupPath.c_str(), 0755)");
-    return false;
+// Prints the output of a running container from its log ring, optionally
+// following it until the container exits.
+int logsMain(int argc, char** argv) {
+  bool follow = false;
+  std::string id;
+
+  po::options_description options{"Options"};
+  options.add_options()
+    ("help,h", "Print help message")
+    ("follow,f", po::bool_switch(&follow),
+     "Keep printing new output until the container exits");
+
+  po::options_description hiddenOptions{"Hidden Options"};
+  hiddenOptions.add_options()("id", po::value<std::string>(&id));
+  po::positional_options_description posOptions;
+  posOptions.add("id", 1);
+  po::options_description cmdlineOptions;
+  cmdlineOptions.add(options).add(hiddenOptions);
+
+  po::variables_map vm;
+  try {
+    po::store(
+        po::command_line_parser(argc, argv)
+            .options(cmdlineOptions)
+            .positional(posOptions)
+            .run(),
+        vm);
+    po::notify(vm);
+  } catch (const po::error& ex) {
+    std::cerr << ex.what() << std::endl;
+    return -1;
+  }
+  if (vm.count("help") || id.empty()) {
+    std::cout << "Usage: mini_container logs [options] ID" << std::endl
+              << std::endl;
+    std::cout << options << std::endl;
+    return 0;
   }
 
-  // (2) Set up resource limit
-  // Memory
-  if (limit.maxRamBytes > 0) {
-    // Try not to reclaim before hitting 75% of the max limit
-    int memoryLow = limit.maxRamBytes * 75 / 100;
-    int memoryMax = limit.maxRamBytes;
-    if (!writeToFile(cgroupPath + "/memory.low", std::to_string(memoryLow))) {
-      return false;
+  const std::string path = getContainerStateDir(id) + "/log.ring";
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < kLogRingDataOffset) {
+    std::cerr << "Error: No captured output of container " << id
+              << std::endl;
+    return -1;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    errExit("mmap(log ring)");
+  }
+  close(fd);
+  const LogRingHeader* header = static_cast<const LogRingHeader*>(addr);
+  const char* data = static_cast<const char*>(addr) + kLogRingDataOffset;
+  if (header->magic != kLogRingMagic ||
+      header->size + kLogRingDataOffset > static_cast<uint64_t>(st.st_size)) {
+    std::cerr << "Error: Invalid log ring " << path << std::endl;
+    return -1;
+  }
+  const uint64_t size = header->size;
+
+  std::vector<char> buf(kLogRecordMaxLength);
+  uint64_t pos = header->tail.load(std::memory_order_acquire);
+  uint64_t expectedSeq = 0;
+  for (;;) {
+    const bool closed = header->closed.load(std::memory_order_acquire);
+    const uint64_t head = header->head.load(std::memory_order_acquire);
+    if (pos == head) {
+      if (!follow || closed) {
+        break;
+      }
+      // Readers only poll the ring, so they add no load to the agent.
+      usleep(kLogFollowIntervalUs);
+      continue;
     }
-    if (!writeToFile(cgroupPath + "/memory.max", std::to_string(memoryMax))) {
-      return false;
+    // Copy the record, then make sure it wasn't overwritten meanwhile. Until
+    // then, its length may be torn, so the copy is kept within the ring.
+    const size_t offset = pos % size;
+    LogRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    const size_t length = std::min<size_t>(
+        {record.length, kLogRecordMaxLength, size - offset - sizeof(record)});
+    memcpy(buf.data(), data + offset + sizeof(record), length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->begin.load(std::memory_order_relaxed) > pos + size ||
+        pos < header->tail.load(std::memory_order_relaxed)) {
+      // Fell behind the writer. Start over from the oldest record.
+      pos = header->tail.load(std::memory_order_acquire);
+      continue;
+    }
+    pos += getLogRecordSize(record.length);
+    if (record.stream == kLogRecordPadding) {
+      continue;
+    }
+    if (expectedSeq != 0 && record.seq != expectedSeq) {
+      std::cerr << "[Logs] Skipped " << record.seq - expectedSeq
+                << " records" << std::endl;
+    }
+    expectedSeq = record.seq + 1;
+    const int outfd = record.stream == 2 ? STDERR_FILENO : STDOUT_FILENO;
+    for (size_t done = 0; done < length;) {
+      ssize_t n = write(outfd, buf.data() + done, length - done);
+      if (n == -1) {
+        return -1;
+      }
+      done += n;
     }
   }
-
-  // (3) Move the container process to the cgroup
-  return writeToFile(cgroupPath + "/cgroup.procs", std::to_string(cpid));
+  return 0;
 }
 
-void removeCgroup(const std::string& cgroupPath) {
-  if (rmdir(cgroupPath.c_str()) == -1) {
-    errExit("rmdir(cgroupPath)");
+// Attaches the terminal to a running container started with --tty. The
+// terminal is passed to the agent, which relays it to the pty of the
+// container until it is detached with Ctrl-P Ctrl-Q or the container exits.
+int attachMain(int argc, char** argv) {
+  if (argc != 2 || argv[1][0] == '-') {
+    std::cout << "Usage: mini_container attach ID" << std::endl
+              << std::endl
+              << "Detach with Ctrl-P Ctrl-Q." << std::endl;
+    return 0;
+  }
+  const std::string id = argv[1];
+  const std::string path = getContainerStateDir(id) + "/attach.sock";
+  int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (sockfd == -1 || path.size() >= sizeof(addr.sun_path)) {
+    errExit("socket(attach)");
+  }
+  strcpy(addr.sun_path, path.c_str());
+  if (connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) == -1) {
+    std::cerr << "Error: Container " << id << " has no tty to attach to"
+              << std::endl;
+    return -1;
   }
-}
 
-void waitForAgent(int pipefd[2]) {
-  // Close unused write end of the pipe
-  if (close(pipefd[1]) == -1) {
-    errExit("[Container] close(pipefd[1])");
+  // Window size changes are passed on to the agent.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
+    errExit("sigprocmask");
   }
-  int ret = 0;
-  bool success = false;
-  // Wait until agent writes to the pipe
-  do {
-    ret = read(pipefd[0], &success, sizeof(success));
-  } while (ret == -1 && errno == EINTR);
-  if (ret != sizeof(success) || !success) {
-    errExit("[Container] Preparation failed");
+  int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sigfd == -1) {
+    errExit("signalfd");
+  }
+  struct termios saved;
+  bool raw = makeRawTerminal(STDIN_FILENO, saved);
+  const int fds[2] = {STDIN_FILENO, STDOUT_FILENO};
+  if (!sendFds(sockfd, fds, 2)) {
+    errExit("sendmsg(attach)");
   }
 
-  // Read end of the pipe is no longer needed. Close it.
-  if (close(pipefd[0]) == -1) {
-    errExit("[Container] close(pipefd[0])");
+  // The agent closes the connection on detach.
+  struct pollfd pfds[2] = {{sockfd, POLLIN, 0}, {sigfd, POLLIN, 0}};
+  for (;;) {
+    if (poll(pfds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      const char c = 0;
+      if (read(sigfd, &info, sizeof(info)) == sizeof(info) &&
+          write(sockfd, &c, 1) != 1) {
+        break;
+      }
+    }
+    if (pfds[0].revents) {
+      break;
+    }
   }
+  if (raw) {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+  }
+  std::cerr << std::endl << "[Attach] Detached from " << id << std::endl;
+  return 0;
 }
 
 int main(int argc, char** argv) {
+  if (argc > 1 && std::string(argv[1]) == "build-rootfs") {
+    return buildRootfsMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && std::string(argv[1]) == "dedupe") {
+    return dedupeMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && std::string(argv[1]) == "exec") {
+    return execMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && std::string(argv[1]) == "logs") {
+    return logsMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && std::string(argv[1]) == "attach") {
+    return attachMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && std::string(argv[1]) == "gc") {
+    return gcMain(argc - 1, argv + 1);
+  }
+
   std::string rootfs;
   std::string hostname;
   std::string domain;
@@ -311,8 +6029,36 @@ int main(int argc, char** argv) {
 
   bool enablePid = false;
   bool enableIpc = false;
+  bool enableInit = false;
+  bool enableTty = false;
 
   ResourceLimit limit;
+  RootfsImage image;
+  int rootTreeFd = -1;
+  bool minimalMountNs = false;
+  int mountNsTemplateFd = -1;
+  int prefetchRecordSecs = 0;
+  // (option, spec) of --volume and --tmpfs in command line order, which is
+  // the order they are mounted in.
+  std::vector<std::pair<std::string, std::string>> mountSpecs;
+  std::vector<Volume> volumes;
+  std::string usernsSpec;
+  IdMapping idMapping;
+  LogOptions logOptions;
+  std::string seccompProfile;
+  std::string seccompRecordFile;
+  std::vector<std::string> envVars;
+  std::vector<std::string> publishSpecs;
+  std::vector<PortMapping> ports;
+  NetShaping shaping;
+  NetworkOptions network;
+  bool fastPath = false;
+  std::vector<std::string> envFiles;
+  std::string name;
+  std::string joinTarget;
+  std::string joinNsList;
+  int joinFlags = 0;
+  int joinPidfd = -1;
 
   po::options_description options{"Options"};
   options.add_options()
@@ -320,55 +6066,416 @@ int main(int argc, char** argv) {
     ("verbose,v", po::bool_switch(&verbose)->default_value(false),
      "Enable verose logging")
     ("rootfs,r", po::value<std::string>(&rootfs),
-     "Root filesystem path of the container")
+     "Root filesystem path of the container, either a directory or an EROFS "
+     "or squashfs image file")
+    ("overlay", po::bool_switch(&image.overlay),
+     "Put a tmpfs overlay on top of the rootfs so that the container can "
+     "write to an image rootfs. The writes are discarded on exit")
+    ("volume,V", po::value<std::vector<std::string>>(),
+     "Mount a host path into the container, as HOST_PATH:CONTAINER_PATH"
+     "[:OPTIONS] where OPTIONS is a comma separated list of ro, rw, noatime, "
+     "nosuid, nodev and noexec. Requires --rootfs. Volumes and --tmpfs are "
+     "mounted in the order given. A missing mount point is created in "
+     "memory, not in the rootfs, but its top-level directory must exist "
+     "without --overlay")
+    ("tmpfs", po::value<std::vector<std::string>>(),
+     "Mount a tmpfs in the container, as CONTAINER_PATH[:OPTIONS] where "
+     "OPTIONS is a comma separated list of size=BYTES, nr_inodes=N, "
+     "mode=OCTAL, huge=never|always|within_size|advise, ro, noatime and "
+     "noexec, e.g. /dev/shm:size=1g,huge=within_size. Requires --rootfs")
+    ("minimal-mountns", po::bool_switch(&minimalMountNs),
+     "Start the mount namespace of the container from an empty template "
+     "instead of a copy of the host's, so that the start time doesn't grow "
+     "with the number of mounts on the host")
+    ("prefetch-record", po::value<int>(&prefetchRecordSecs),
+     "Record the rootfs pages read in the first N seconds to "
+     "<rootfs>.prefetch, which are prefetched in later runs. Run it with a "
+     "cold page cache")
+    ("name", po::value<std::string>(&name),
+     "Name of the container, for --join. Defaults to its pid")
+    ("join", po::value<std::string>(&joinTarget),
+     "Run the container in the namespaces of a running container, given "
+     "by name or pid, e.g. to run a sidecar that talks to it over loopback")
+    ("join-ns", po::value<std::string>(&joinNsList)
+         ->default_value("net,ipc,uts,pid,mnt"),
+     "Comma separated list of the namespaces to join with --join")
+    ("userns", po::value<std::string>(&usernsSpec),
+     "Run the container in a user namespace, as HOSTID[:COUNT], mapping "
+     "its uids and gids 0..COUNT-1 to HOSTID.. on the host. COUNT defaults "
+     "to 65536. The rootfs and volumes are idmapped mounts, so they can be "
+     "shared with containers of other ranges. Implies --pid. This is not "
+     "rootless: mini_container itself still has to run as root")
     ("pid,p", po::bool_switch(&enablePid)->default_value(false),
      "Enable PID isolation")
+    ("tty,t", po::bool_switch(&enableTty),
+     "Run the command on a pseudo terminal, relayed to the terminal of the "
+     "agent. \"attach ID\" attaches another terminal. Detach with Ctrl-P "
+     "Ctrl-Q")
+    ("init", po::bool_switch(&enableInit),
+     "Run a minimal init as PID 1 that forwards signals to the command and "
+     "reaps orphaned processes")
     ("hostname,h", po::value<std::string>(&hostname),
      "Hostname of the container")
     ("domain,d", po::value<std::string>(&domain),
      "NIS domain name of the container")
     ("ipc,i", po::bool_switch(&enableIpc),
      "Enable IPC isolation")
-    // TODO: Dynamically allocate IP address.
     ("ip", po::value<std::string>(&ip),
-     "IP of the container")
+     "IP of the container in the bridge network 10.0.0.0/16, or \"auto\" to "
+     "allocate a free one. In the other --net-mode modes, ADDR[/PREFIX] in "
+     "the network of --net-parent, whose prefix length is the default")
+    ("net-mode", po::value<std::string>(&network.mode)
+         ->default_value("bridge"),
+     "How the container is connected: bridge for a veth pair to the bridge "
+     "br0 with NAT, routed for a veth pair with a /32 route and no bridge, "
+     "or macvlan, ipvlan-l2 or ipvlan-l3 for a sub-interface "
+     "of --net-parent, which skips the bridge and netfilter. The host can't "
+     "reach a macvlan container through the parent itself. These require "
+     "--ip. none for a network namespace of only lo, down, loopback for one "
+     "of only lo, up, and host to share the network of the host, which is "
+     "the default without --ip")
+    ("net-parent", po::value<std::string>(&network.parent),
+     "Host interface of the macvlan or ipvlan interface of the container")
+    ("gateway", po::value<std::string>(&network.gateway),
+     "Default gateway of a macvlan or ipvlan container")
+    ("fast-path", po::bool_switch(&fastPath),
+     "Send what the container sends to other --fast-path containers "
+     "straight into their network namespace with a TC BPF program on its "
+     "veth, skipping the bridge and netfilter. Requires --ip in bridge or "
+     "routed mode")
+    ("publish,P", po::value<std::vector<std::string>>(&publishSpecs),
+     "Publish a port of the container on the host, as "
+     "HOST_PORT:CONTAINER_PORT[/tcp|/udp]. Requires --ip in bridge or "
+     "routed mode")
+    ("net-rate", po::value<uint64_t>(&shaping.rate),
+     "Limit what the container sends and receives to this many bytes per "
+     "second each, or only what it sends in macvlan and ipvlan modes. "
+     "Requires --ip")
+    ("net-burst", po::value<uint32_t>(&shaping.burst),
+     "Bytes the container may send or receive at once above --net-rate. "
+     "Defaults to 64KiB")
+    ("env,e", po::value<std::vector<std::string>>(&envVars),
+     "Set an environment variable of the command, as KEY=VALUE, or as KEY "
+     "to pass the variable of the host. PATH defaults to /usr/local/sbin:"
+     "/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin")
+    ("env-file", po::value<std::vector<std::string>>(&envFiles),
+     "Read environment variables from a file of KEY=VALUE lines")
+    ("log-dir", po::value<std::string>(&logOptions.dir),
+     "Capture the stdout and stderr of the command into <ID>.stdout.log and "
+     "<ID>.stderr.log in this directory, where ID is the name or the pid of "
+     "the container. The last 64KiB are printed if the container fails")
+    ("log-max-size", po::value<long long>(&logOptions.maxSize),
+     "Rotate a log file once it reaches this many bytes")
+    ("log-max-files", po::value<int>(&logOptions.maxFiles)->default_value(5),
+     "Number of rotated log files to keep")
+    ("log-ring-size", po::value<size_t>(&logOptions.ringSize)
+         ->default_value(1024 * 1024),
+     "Size of the in-memory ring of the last output that \"logs ID\" reads "
+     "while the container runs, or 0 for none. It is at least 64KiB")
+    ("seccomp", po::value<std::string>(&seccompProfile),
+     "Restrict the syscalls of the command with a seccomp profile, a file of "
+     "\"default allow|kill|errno N\" and \"allow|deny|kill|errno N SYSCALL "
+     "[COUNT]\" lines. The most frequent allowed syscalls by COUNT are "
+     "checked first. The profile must allow execveat. Commands run with "
+     "\"exec ID\" are held to it too")
+    ("seccomp-record", po::value<std::string>(&seccompRecordFile),
+     "Record the syscalls of the container and their counts to a seccomp "
+     "profile. Every syscall goes through the agent, so this is slow")
     ("max-ram,R", po::value<long long>(&limit.maxRamBytes),
      "The max amount of ram (in bytes) that the container can use");
 
-  std::string cmd;
-  po::options_description hiddenOptions{"Hidden Options"};
-  hiddenOptions.add_options()("cmd", po::value<std::string>(&cmd));
-
-  po::positional_options_description posOptions;
-  posOptions.add("cmd", -1);
-
-  po::options_description cmdlineOptions;
-  cmdlineOptions.add(options).add(hiddenOptions);
+  // The command is passed to the container as is, so it isn't parsed.
+  Command command;
+  const int commandStart = findCommandStart(argc, argv, options);
+  command.args.assign(argv + commandStart, argv + argc);
 
   po::variables_map vm;
   try {
-    po::parsed_options parsedOptions = po::command_line_parser(argc, argv)
-                                           .options(cmdlineOptions)
-                                           .positional(posOptions)
-                                           .run();
+    po::parsed_options parsedOptions =
+        po::command_line_parser(commandStart, argv).options(options).run();
 
     po::store(parsedOptions, vm);
     po::notify(vm);
+    for (const auto& option : parsedOptions.options) {
+      if (option.string_key == "volume" || option.string_key == "tmpfs") {
+        for (const auto& spec : option.value) {
+          mountSpecs.push_back({option.string_key, spec});
+        }
+      }
+    }
   } catch (const po::error& ex) {
     std::cerr << ex.what() << std::endl;
     return -1;
   }
-  if (vm.count("help") || !vm.count("cmd")) {
-    std::cout << "Usage: " << argv[0] << " [options] COMMAND" << std::endl
+  if (vm.count("help") || command.args.empty()) {
+    std::cout << "Usage: " << argv[0] << " [options] COMMAND [ARG]..."
+              << std::endl
+              << "       " << argv[0] << " build-rootfs [options] BINARY..."
+              << std::endl
+              << "       " << argv[0] << " dedupe [options] ROOTFS..."
+              << std::endl
+              << "       " << argv[0] << " exec [options] ID COMMAND..."
+              << std::endl
+              << "       " << argv[0] << " logs [options] ID" << std::endl
+              << "       " << argv[0] << " attach ID" << std::endl
+              << "       " << argv[0] << " gc" << std::endl
               << std::endl;
     std::cout << options << std::endl;
     return 0;
   }
 
+  for (const auto& spec : mountSpecs) {
+    Volume volume;
+    const bool isTmpfs = spec.first == "tmpfs";
+    if (rootfs.empty() || !(isTmpfs ? parseTmpfs(spec.second, volume)
+                                    : parseVolume(spec.second, volume))) {
+      std::cerr << "Error: Invalid " << (isTmpfs ? "tmpfs " : "volume ")
+                << spec.second << std::endl;
+      return -1;
+    }
+    volumes.push_back(volume);
+  }
+  for (const auto& spec : publishSpecs) {
+    PortMapping mapping;
+    if (ip.empty() || !parsePortMapping(spec, mapping)) {
+      std::cerr << "Error: Invalid port " << spec << std::endl;
+      return -1;
+    }
+    ports.push_back(mapping);
+  }
+  if (shaping.rate > 0 && ip.empty()) {
+    std::cerr << "Error: --net-rate requires --ip" << std::endl;
+    return -1;
+  }
+  if (fastPath && ip.empty()) {
+    std::cerr << "Error: --fast-path requires --ip" << std::endl;
+    return -1;
+  }
+  if (std::find(kNetModes.begin(), kNetModes.end(), network.mode) ==
+      kNetModes.end()) {
+    std::cerr << "Error: Invalid network mode " << network.mode << std::endl;
+    return -1;
+  }
+  if (vm["net-mode"].defaulted() && ip.empty()) {
+    network.mode = "host";
+  }
+  if (network.mode == "none" || network.mode == "loopback" ||
+      network.mode == "host") {
+    if (!ip.empty() || !network.parent.empty() || !network.gateway.empty()) {
+      std::cerr << "Error: --net-mode " << network.mode << " takes no --ip, "
+                << "--net-parent or --gateway" << std::endl;
+      return -1;
+    }
+  } else if (hasVethPair(network)) {
+    if (ip.empty()) {
+      std::cerr << "Error: --net-mode " << network.mode << " requires --ip"
+                << std::endl;
+      return -1;
+    }
+    if (!network.parent.empty() || !network.gateway.empty()) {
+      std::cerr << "Error: --net-parent and --gateway require a macvlan or "
+                << "ipvlan --net-mode" << std::endl;
+      return -1;
+    }
+    const bool routed = network.mode == "routed";
+    network.prefixLen = routed ? "32" : kDefaultBridgePrefixLen;
+    network.gateway = routed ? kRoutedGatewayIp : kDefaultBridgeIp;
+  } else {
+    if (ip.empty() || ip == "auto" || network.parent.empty()) {
+      std::cerr << "Error: --net-mode " << network.mode << " requires --ip "
+                << "ADDR[/PREFIX] and --net-parent" << std::endl;
+      return -1;
+    }
+    if (!ports.empty() || fastPath) {
+      std::cerr << "Error: --publish and --fast-path require --net-mode "
+                << "bridge or routed" << std::endl;
+      return -1;
+    }
+    const size_t slash = ip.find('/');
+    if (slash != std::string::npos) {
+      network.prefixLen = ip.substr(slash + 1);
+      ip.resize(slash);
+    } else {
+      network.prefixLen = getInterfacePrefixLen(network.parent);
+    }
+    uint32_t addr;
+    if (!parseIp(ip, addr) || network.prefixLen.empty() ||
+        network.prefixLen.find_first_not_of("0123456789") !=
+            std::string::npos ||
+        network.prefixLen.size() > 2 || std::stoi(network.prefixLen) > 32) {
+      std::cerr << "Error: Invalid IP " << ip << "/" << network.prefixLen
+                << std::endl;
+      return -1;
+    }
+    if (!network.gateway.empty() && !parseIp(network.gateway, addr)) {
+      std::cerr << "Error: Invalid gateway " << network.gateway << std::endl;
+      return -1;
+    }
+  }
+
+  command.env.push_back("PATH=" + kDefaultPath);
+  // The files are read in order, and -e comes last, so that later ones win.
+  std::vector<std::string> fileVars;
+  for (const auto& file : envFiles) {
+    if (!readEnvFile(file, fileVars)) {
+      std::cerr << "Error: Failed to read " << file << std::endl;
+      return -1;
+    }
+  }
+  envVars.insert(envVars.begin(), fileVars.begin(), fileVars.end());
+  for (const auto& var : envVars) {
+    if (!setEnv(var, command.env)) {
+      std::cerr << "Error: Invalid environment variable " << var << std::endl;
+      return -1;
+    }
+  }
+
+  if (enableTty && !logOptions.dir.empty()) {
+    std::cerr << "Error: --tty can't be used with --log-dir" << std::endl;
+    return -1;
+  }
+
+  int seccompRecordFd = -1;
+  if (!seccompProfile.empty() && !seccompRecordFile.empty()) {
+    std::cerr << "Error: --seccomp can't be used with --seccomp-record"
+              << std::endl;
+    return -1;
+  } else if (!seccompProfile.empty()) {
+    SeccompProfile profile;
+    if (!readSeccompProfile(seccompProfile, profile)) {
+      std::cerr << "Error: Invalid seccomp profile " << seccompProfile
+                << std::endl;
+      return -1;
+    }
+    command.seccompFilter = compileSeccompProfile(profile);
+    if (command.seccompFilter.size() > BPF_MAXINSNS) {
+      std::cerr << "Error: Seccomp profile is too large" << std::endl;
+      return -1;
+    }
+  } else if (!seccompRecordFile.empty()) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+      errExit("socketpair");
+    }
+    seccompRecordFd = sv[0];
+    command.seccompSocket = sv[1];
+    command.seccompFilter = getSeccompRecordFilter(sv[1]);
+  }
+
+  if (!name.empty() &&
+      (name.find('/') != std::string::npos || name[0] == '.' ||
+       name.find_first_not_of("0123456789") == std::string::npos)) {
+    std::cerr << "Error: Invalid name " << name << std::endl;
+    return -1;
+  }
+  if (!joinTarget.empty()) {
+    if (!parseJoinNamespaces(joinNsList, joinFlags)) {
+      std::cerr << "Error: Invalid namespaces " << joinNsList << std::endl;
+      return -1;
+    }
+    // Options that would set up a namespace that is joined instead.
+    if (((joinFlags & CLONE_NEWNS) &&
+         (!rootfs.empty() || minimalMountNs)) ||
+        ((joinFlags & CLONE_NEWNET) && network.mode != "host") ||
+        ((joinFlags & CLONE_NEWUTS) &&
+         (!hostname.empty() || !domain.empty())) ||
+        ((joinFlags & CLONE_NEWPID) && enablePid) ||
+        ((joinFlags & CLONE_NEWIPC) && enableIpc) || !usernsSpec.empty()) {
+      std::cerr << "Error: Options conflict with the joined namespaces"
+                << std::endl;
+      return -1;
+    }
+    joinPidfd = openContainerPidfd(joinTarget);
+    if (joinPidfd == -1) {
+      std::cerr << "Error: No running container " << joinTarget << std::endl;
+      return -1;
+    }
+  }
+  if (!name.empty() && !reserveContainerState(name)) {
+    std::cerr << "Error: Container " << name << " already exists"
+              << std::endl;
+    return -1;
+  }
+
+  if (!usernsSpec.empty()) {
+    if (!parseIdMapping(usernsSpec, idMapping)) {
+      std::cerr << "Error: Invalid user namespace " << usernsSpec << std::endl;
+      return -1;
+    }
+    // The template mount namespace is owned by the host's user namespace,
+    // which the container can't join.
+    if (minimalMountNs) {
+      std::cerr << "Error: --minimal-mountns can't be used with --userns"
+                << std::endl;
+      return -1;
+    }
+    // procfs can only be mounted by the owner of the PID namespace.
+    enablePid = true;
+  }
+
   int flags = SIGCHLD;
+  if (idMapping.count > 0) {
+    flags |= CLONE_NEWUSER;
+  }
   if (!rootfs.empty()) {
-    flags |= CLONE_NEWNS;
+    if (minimalMountNs) {
+      mountNsTemplateFd = openMountNsTemplate();
+    } else {
+      flags |= CLONE_NEWNS;
+    }
+
+    struct stat st;
+    if (stat(rootfs.c_str(), &st) == -1) {
+      errExit("stat(rootfs)");
+    }
+    if (S_ISREG(st.st_mode)) {
+      image.fsType = getImageFsType(rootfs);
+      if (image.fsType.empty()) {
+        std::cerr << "Error: " << rootfs
+                  << " is not an EROFS or squashfs image" << std::endl;
+        return -1;
+      }
+      image.loopfd = attachLoopDevice(rootfs, image.device);
+      if (verbose) {
+        std::cout << "[Agent] Attached " << image.fsType << " image to "
+                  << image.device << std::endl;
+      }
+    }
+    rootTreeFd = buildRootfsTree(rootfs, image);
+    for (auto& volume : volumes) {
+      prepareVolume(volume);
+    }
+  }
+  // Find the executable in the root the container is going to have, so that
+  // the container only needs to exec it.
+  int execRootFd = rootTreeFd;
+  if (rootTreeFd == -1 && (joinFlags & CLONE_NEWNS)) {
+    const std::string joinRoot =
+        "/proc/" + std::to_string(getPidfdPid(joinPidfd)) + "/root";
+    execRootFd = open(joinRoot.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  } else if (rootTreeFd == -1) {
+    execRootFd = AT_FDCWD;
+  }
+  command.fd = openExecutable(execRootFd, command);
+  if (command.fd == -1) {
+    std::cerr << "Error: " << command.args[0] << " not found" << std::endl;
+    if (!name.empty()) {
+      removeContainerState(name);
+    }
+    return -1;
+  }
+  if (execRootFd != rootTreeFd && execRootFd != AT_FDCWD) {
+    close(execRootFd);
+  }
+  for (auto& arg : command.args) {
+    command.argv.push_back(&arg[0]);
+  }
+  command.argv.push_back(nullptr);
+  for (auto& var : command.env) {
+    command.envp.push_back(&var[0]);
   }
+  command.envp.push_back(nullptr);
+
   if (enablePid) {
     flags |= CLONE_NEWPID;
   }
@@ -378,12 +6485,53 @@ int main(int argc, char** argv) {
   if (enableIpc) {
     flags |= CLONE_NEWIPC;
   }
-  if (!ip.empty()) {
-    // TODO: Validate the IP address and make sure it belongs to the default
-    // bridge network
+  // The address is held by the agent until the container exits. Routed
+  // containers take theirs from the bridge network too.
+  Ipam ipam;
+  int64_t ipIndex = -1;
+  if (!ip.empty() && hasVethPair(network)) {
+    openIpam(ipam);
+    const bool autoIp = ip == "auto";
+    ipIndex = reserveIp(ipam, ip);
+    if (ipIndex == -1) {
+      if (!name.empty()) {
+        removeContainerState(name);
+      }
+      return -1;
+    }
+    if (autoIp) {
+      std::cout << "[Agent] Allocated IP address " << ip << std::endl;
+    }
+  }
+  if (network.mode != "host") {
     flags |= CLONE_NEWNET;
   }
 
+  // The agent relays the output of the command from pipes into the log files.
+  int logPipes[2][2] = {{-1, -1}, {-1, -1}};
+  if (!logOptions.dir.empty()) {
+    if (mkdir(logOptions.dir.c_str(), 0755) == -1 && errno != EEXIST) {
+      errExit("mkdir(log dir)");
+    }
+    for (auto& logPipe : logPipes) {
+      if (pipe2(logPipe, O_CLOEXEC) == -1) {
+        errExit("pipe2(log)");
+      }
+      // Fewer wakeups of the agent for chatty commands.
+      fcntl(logPipe[1], F_SETPIPE_SZ, kLogChunkSize);
+    }
+    command.stdoutFd = logPipes[0][1];
+    command.stderrFd = logPipes[1][1];
+    logOptions.devNullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  }
+
+  // The agent relays between the pty and its terminal.
+  int ttyMasterFd = -1;
+  if (enableTty) {
+    ttyMasterFd = openPty(command.ttyFd);
+    copyWindowSize(STDIN_FILENO, ttyMasterFd);
+  }
+
   int pipefd[2];
   if (pipe(pipefd) != 0) {
     errExit("pipe failed");
@@ -391,6 +6539,13 @@ int main(int argc, char** argv) {
   int readfd = pipefd[0];
   int writefd = pipefd[1];
 
+  // The container is created in the joined namespaces instead of new ones.
+  std::vector<int> savedNsFds;
+  if (joinPidfd != -1) {
+    savedNsFds = enterNamespaces(joinPidfd, joinFlags);
+    close(joinPidfd);
+  }
+
   // We need to make a raw syscall because we need something like fork(flags)
   // but there is no such wrapper available. In other words, we need to fork
   // current process and create namespaces specified by flags.
@@ -407,22 +6562,33 @@ int main(int argc, char** argv) {
   if (cpid == -1) {
     errExit("fork failed");
   }
+  if (cpid != 0 && !savedNsFds.empty()) {
+    leaveNamespaces(savedNsFds);
+  }
 
   if (cpid == 0) {
     // Container
     std::cout << "[Container] Waiting for agent to finish preparation ..."
               << std::endl;
     waitForAgent(pipefd);
+    if (idMapping.count > 0) {
+      becomeUserNsRoot();
+    }
 
     if (!ip.empty()) {
       std::cout << "[Container] Setting up container network ..." << std::endl;
-      setupNetwork(ip);
+      setupNetwork(ip, network);
       std::cout << "[Container] Done setting up container network" << std::endl;
+    } else if (network.mode == "loopback") {
+      setupLoopback();
     }
 
-    setupFilesystem(rootfs);
+    setupFilesystem(rootTreeFd, image.overlay, mountNsTemplateFd, volumes);
     setHostAndDomainName(hostname, domain);
-    runContainer(cmd);
+    if (enableInit) {
+      runInit(command);
+    }
+    runContainer(command);
   } else {
     // Agent
     if (verbose) {
@@ -432,13 +6598,121 @@ int main(int argc, char** argv) {
       std::cout << "[Agent] Agent NIS domain name: " << getNisDomainName()
                 << std::endl;
     }
+    if (mountNsTemplateFd != -1) {
+      close(mountNsTemplateFd);
+    }
+    const std::string id = name.empty() ? std::to_string(cpid) : name;
+    // A --seccomp-record filter only records, so it isn't saved.
+    bool success = (!name.empty() || reserveContainerState(id)) &&
+        (command.seccompFilter.empty() || command.seccompSocket != -1 ||
+         writeSeccompState(id, command.seccompFilter)) &&
+        writeContainerState(id, cpid);
+    if (success && idMapping.count > 0) {
+      success = writeIdMaps(cpid, idMapping);
+      if (success && rootTreeFd != -1) {
+        idmapMountTrees(cpid, rootTreeFd, volumes);
+      }
+    }
+    for (const auto& volume : volumes) {
+      close(volume.treefd);
+    }
+    std::thread logRelay;
+    int logTailFd = -1;
+    if (!logOptions.dir.empty()) {
+      close(logPipes[0][1]);
+      close(logPipes[1][1]);
+      const std::string logPrefix = logOptions.dir + "/" + id;
+      const std::vector<std::pair<int, std::string>> pipes = {
+          {logPipes[0][0], logPrefix + ".stdout.log"},
+          {logPipes[1][0], logPrefix + ".stderr.log"}};
+      logRelay = std::thread([&logTailFd, cpid, id, pipes, &logOptions]() {
+        logTailFd = relayLogs(
+            cpid, pipes, logOptions, getContainerStateDir(id) + "/log.ring");
+      });
+    }
+    std::thread ttyRelay;
+    if (ttyMasterFd != -1) {
+      close(command.ttyFd);
+      // Only the relay handles SIGWINCH, through a signalfd.
+      sigset_t mask;
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGWINCH);
+      if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
+        errExit("[Agent] sigprocmask");
+      }
+      const int listenfd =
+          listenForAttach(getContainerStateDir(id) + "/attach.sock");
+      ttyRelay = std::thread([cpid, ttyMasterFd, listenfd]() {
+        relayTty(cpid, ttyMasterFd, listenfd);
+      });
+    }
+    std::map<int, uint64_t> syscallCounts;
+    std::thread syscallRecorder;
+    if (seccompRecordFd != -1) {
+      close(command.seccompSocket);
+      // The container's syscalls wait for the agent from the exec on, so they
+      // are served on a thread of their own.
+      syscallRecorder = std::thread([&syscallCounts, seccompRecordFd]() {
+        syscallCounts = recordSyscalls(seccompRecordFd);
+      });
+    }
+    // Read the rootfs pages the container is going to need into the page
+    // cache while the container is being prepared.
+    const std::string prefetchListPath = getPrefetchListPath(rootfs);
+    std::string prefetchRoot;
+    std::vector<PrefetchRange> prefetchRanges;
+    std::vector<std::thread> prefetchThreads;
+    if (!rootfs.empty() && (prefetchRecordSecs > 0 ||
+                            access(prefetchListPath.c_str(), F_OK) == 0)) {
+      // The agent accesses the files through the rootfs mount tree, which
+      // shares the page cache with the container.
+      prefetchRoot = "/proc/self/fd/" + std::to_string(rootTreeFd);
+    }
+    if (!prefetchRoot.empty() && prefetchRecordSecs == 0) {
+      prefetchRanges = readPrefetchList(prefetchListPath);
+      prefetchThreads = startPrefetch(prefetchRoot, prefetchRanges);
+    }
+
     if (!ip.empty()) {
       std::cout << "[Agent] Preparing network for container ..." << std::endl;
-      prepareNetwork(cpid);
+      if (hasVethPair(network)) {
+        prepareNetwork(cpid, ip, network);
+        // An agent that died may have left the address on the fast path,
+        // pointing at a veth that is gone, and ports published to it.
+        if (fastPath) {
+          success = success && enableFastPath(cpid, ip);
+        } else {
+          disableFastPath(ip);
+        }
+        collectPortsOf(ip);
+      } else {
+        prepareSubInterface(cpid, network);
+      }
       std::cout << "[Agent] Done preparing network for container" << std::endl;
     }
+    const bool published = success && !ports.empty() && publishPorts(ip, ports);
+    // The network namespace is held until the statistics are printed, since
+    // it goes away with the veth pair when the container exits.
+    int netnsFd = -1;
+    if (shaping.rate > 0) {
+      const std::string netnsPath = "/proc/" + std::to_string(cpid) + "/ns/net";
+      netnsFd = open(netnsPath.c_str(), O_RDONLY | O_CLOEXEC);
+      if (netnsFd == -1) {
+        errExit("[Agent] open(netns)");
+      }
+      success = success && shapeNetwork(cpid, netnsFd, network, shaping);
+    }
+    success = success && (ports.empty() || published);
+
+    success = setupCgroup(cpid, limit) && success;
 
-    bool success = setupCgroup(cpid, limit);
+    for (auto& thread : prefetchThreads) {
+      thread.join();
+    }
+    if (verbose && !prefetchRanges.empty()) {
+      std::cout << "[Agent] Prefetched " << prefetchRanges.size()
+                << " ranges from " << prefetchListPath << std::endl;
+    }
 
     // Close unused read end of the pipe
     if (close(readfd) == -1) {
@@ -453,15 +6727,69 @@ int main(int argc, char** argv) {
       errExit("[Agent] close(writefd)");
     }
 
+    if (!prefetchRoot.empty() && prefetchRecordSecs > 0) {
+      waitForContainerOrTimeout(cpid, prefetchRecordSecs * 1000);
+      recordPrefetchList(prefetchRoot, prefetchListPath);
+    }
+    if (rootTreeFd != -1) {
+      close(rootTreeFd);
+    }
+
+    // Remove the state before the container is reaped, so that its pid isn't
+    // reused while the state still points to it.
+    siginfo_t info;
+    if (waitid(P_PID, cpid, &info, WEXITED | WNOWAIT) == -1) {
+      errExit("[Agent] waitid failed");
+    }
+    removeContainerState(id);
     int status;
     if (waitpid(cpid, &status, 0) == -1) {
       errExit("[Agent] waitpid failed");
     }
+    if (netnsFd != -1) {
+      printNetworkStats(cpid, netnsFd, network);
+      close(netnsFd);
+    }
+    if (published) {
+      unpublishPorts(ports);
+    }
+    if (fastPath) {
+      disableFastPath(ip);
+    }
+    if (ipIndex != -1) {
+      releaseIp(ipam, ipIndex, getIpOwner(getpid()));
+    }
+    if (ttyRelay.joinable()) {
+      ttyRelay.join();
+    }
+    if (logRelay.joinable()) {
+      logRelay.join();
+      if (status != 0 && logTailFd != -1) {
+        printLogTail(logTailFd);
+      }
+      if (logTailFd != -1) {
+        close(logTailFd);
+      }
+      close(logOptions.devNullFd);
+    }
+    if (syscallRecorder.joinable()) {
+      syscallRecorder.join();
+      if (!writeSeccompProfile(seccompRecordFile, syscallCounts)) {
+        std::cerr << "Error: Failed to write " << seccompRecordFile
+                  << std::endl;
+      } else if (verbose) {
+        std::cout << "[Agent] Recorded " << syscallCounts.size()
+                  << " syscalls to " << seccompRecordFile << std::endl;
+      }
+    }
     if (verbose) {
       std::cout << "[Agent] The container exited with status: " << status
                 << std::endl;
     }
     removeCgroup(getContainerCgroup(cpid));
+    if (image.loopfd != -1) {
+      close(image.loopfd);
+    }
   }
 
   return 0;